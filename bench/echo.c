@@ -0,0 +1,130 @@
+/*
+ * 回环 echo: nconns 个连接各做 20000 次 4 字节的请求/应答，统计 epoll_ctl 调用次数与每次往返的耗时
+ * 参数 et 为 1 时开启 st_edge_triggered，对比每次等待都注册/删除描述符与只在打开时注册一次
+ * epoll_ctl 通过链接器的 --wrap 计数
+ *
+ *   cd bench && gcc -O2 -I.. ../[a-z]*.c ../md.S echo.c -o echo -lpthread -Wl,--wrap=epoll_ctl
+ *   ./echo 0 4 && ./echo 1 4
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "public.h"
+
+#define NROUNDS  20000
+#define MAXCONNS 64
+
+static long nctl = 0;
+static int port;
+
+int __real_epoll_ctl(int epfd, int op, int fd, void *event);
+
+int __wrap_epoll_ctl(int epfd, int op, int fd, void *event)
+{
+    nctl++;
+    return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+static void *echo(void *arg)
+{
+    st_netfd_t conn = (st_netfd_t) arg;
+    char buf[64];
+    ssize_t n;
+
+    while ((n = st_read(conn, buf, sizeof(buf), ST_UTIME_NO_TIMEOUT)) > 0) {
+        if (st_write(conn, buf, n, ST_UTIME_NO_TIMEOUT) != n)
+            break;
+    }
+    st_netfd_close(conn);
+    return NULL;
+}
+
+static void *server(void *arg)
+{
+    st_netfd_t lfd = (st_netfd_t) arg, conn;
+
+    while ((conn = st_accept(lfd, NULL, NULL, ST_UTIME_NO_TIMEOUT)) != NULL)
+        st_thread_create(echo, conn, 0, 0);
+    return NULL;
+}
+
+static void *client(void *arg)
+{
+    struct sockaddr_in sa;
+    st_netfd_t conn;
+    char buf[4] = "ping";
+    int i;
+
+    (void) arg;
+    if (!(conn = st_netfd_open_socket(socket(AF_INET, SOCK_STREAM, 0)))) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (st_connect(conn, (struct sockaddr*) &sa, sizeof(sa), ST_UTIME_NO_TIMEOUT) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    for (i = 0; i < NROUNDS; i++) {
+        if (st_write(conn, buf, sizeof(buf), ST_UTIME_NO_TIMEOUT) != sizeof(buf) ||
+            st_read_fully(conn, buf, sizeof(buf), ST_UTIME_NO_TIMEOUT) != sizeof(buf)) {
+            perror("echo");
+            exit(1);
+        }
+    }
+    st_netfd_close(conn);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int et = argc > 1 ? atoi(argv[1]) : 0;
+    int nconns = argc > 2 ? atoi(argv[2]) : 4;
+    st_thread_t clients[MAXCONNS];
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    st_utime_t t0, t1;
+    int lfd, one = 1, i;
+
+    if (nconns < 1 || nconns > MAXCONNS) {
+        fprintf(stderr, "nconns must be 1..%d\n", MAXCONNS);
+        return 1;
+    }
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+    st_edge_triggered(et);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr*) &sa, sizeof(sa)) < 0 || listen(lfd, 128) < 0 ||
+        getsockname(lfd, (struct sockaddr*) &sa, &len) < 0) {
+        perror("listen");
+        return 1;
+    }
+    port = ntohs(sa.sin_port);
+    st_thread_create(server, st_netfd_open_socket(lfd), 0, 0);
+
+    t0 = st_utime();
+    for (i = 0; i < nconns; i++)
+        clients[i] = st_thread_create(client, NULL, 1, 0);
+    for (i = 0; i < nconns; i++)
+        st_thread_join(clients[i], NULL);
+    t1 = st_utime();
+
+    printf("et=%d conns=%d: epoll_ctl %ld, %.0f ns/roundtrip\n", et, nconns, nctl,
+           (t1 - t0) * 1000.0 / ((double) nconns * NROUNDS));
+    return 0;
+}
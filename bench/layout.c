@@ -0,0 +1,115 @@
+/*
+ * 大量线程轮流切换时线程对象与 vp 结构的 cache 效率: nthreads 个 16K 栈的线程每个让出 CPU 200 次，
+ * 每次切换都会访问下一个线程的热字段。同时用 perf_event_open 统计每次切换的 LLC 与 L1D 读缺失，
+ * 没有这两个计数器(比如在容器中或 perf_event_paranoid 太高)时直接报错退出，不输出不完整的结果
+ *
+ *   cd bench && gcc -O2 -I.. ../[a-z]*.c ../md.S layout.c -o layout -lpthread
+ *   ./layout 100 && ./layout 10000 && ./layout 30000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "common.h"
+
+#define NYIELDS 200
+
+static long count = 0;
+
+static void yield(void)
+{
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+
+    me->state = _ST_ST_RUNNABLE;
+    _ST_ADD_RUNQ(me);
+    _ST_SWITCH_CONTEXT(me);
+}
+
+static void *worker(void *arg)
+{
+    int i;
+
+    (void) arg;
+    for (i = 0; i < NYIELDS; i++) {
+        count++;
+        yield();
+    }
+    return NULL;
+}
+
+/* 打开一个只统计用户态的计数器，失败时报错退出 */
+static int counter_open(const char *name, unsigned int type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        fprintf(stderr, "perf_event_open(%s): %s\n", name, strerror(errno));
+        exit(1);
+    }
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
+
+static void counter_print(const char *name, int fd, long n)
+{
+    long long v;
+
+    if (ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) < 0 || read(fd, &v, sizeof(v)) != sizeof(v)) {
+        fprintf(stderr, "\nread counter %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    printf(", %s %.2f/switch", name, (double) v / n);
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = argc > 1 ? atoi(argv[1]) : 10000;
+    int llc, l1d, i;
+    long c0, n;
+    st_utime_t t0, t1;
+
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (!st_thread_create(worker, NULL, 0, 16384)) {
+            perror("st_thread_create");
+            return 1;
+        }
+    }
+    /* 第一轮让所有线程都跑起来，栈与线程对象都已经分配好 */
+    yield();
+
+    llc = counter_open("LLC miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    l1d = counter_open("L1D miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    c0 = count;
+    t0 = st_utime();
+    while (count < (long) nthreads * NYIELDS)
+        yield();
+    t1 = st_utime();
+    n = count - c0;
+
+    printf("%d threads: %.1f ns/switch", nthreads, (t1 - t0) * 1000.0 / n);
+    counter_print("LLC miss", llc, n);
+    counter_print("L1D miss", l1d, n);
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * runnext 的效果: 被 st_cond_signal、st_mutex_unlock 唤醒的线程是否紧接着运行
+ * 1. 64 对线程用条件变量轮流处理各自的 16K 缓冲区，唤醒后马上运行时缓冲区还在 cache 中
+ * 2. 8 个线程争用一个 mutex，持有期间处理 16K 数据并让出一次 CPU
+ * 3. 防饿死: 一对相互唤醒的线程旁边有一个不停让出 CPU 的线程，它也必须持续得到运行
+ *
+ *   cd bench && gcc -O2 -I.. ../[a-z]*.c ../md.S runnext.c -o runnext -lpthread
+ *   ./runnext 0 && ./runnext 1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "public.h"
+
+#define NPAIRS   64
+#define NMUTEX   8
+#define BUFSIZE  (16 * 1024)
+#define NROUNDS  20000
+
+typedef struct {
+    st_cond_t cond[2];
+    int turn;
+    char *buf;
+} pair_t;
+
+static pair_t pairs[NPAIRS];
+static st_mutex_t lock;
+static char shared[BUFSIZE];
+static st_cond_t guard_cond[2];
+static int guard_turn = 0;
+static int guard_stop = 0;
+static long guard_other = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *pair_side(void *arg)
+{
+    long v = (long) arg;
+    pair_t *p = &pairs[v >> 1];
+    int id = (int) (v & 1), r, i;
+    unsigned long sum = 0;
+
+    for (r = 0; r < NROUNDS; r++) {
+        while (p->turn != id)
+            st_cond_wait(p->cond[id]);
+        for (i = 0; i < BUFSIZE; i += 64) {
+            sum += p->buf[i];
+            p->buf[i] = (char) (sum + r);
+        }
+        p->turn = !id;
+        st_cond_signal(p->cond[!id]);
+    }
+    return (void*) sum;
+}
+
+static void *mutex_worker(void *arg)
+{
+    int r, i;
+
+    (void) arg;
+    for (r = 0; r < NROUNDS; r++) {
+        st_mutex_lock(lock);
+        for (i = 0; i < BUFSIZE; i += 64)
+            shared[i]++;
+        st_thread_yield();
+        st_mutex_unlock(lock);
+    }
+    return NULL;
+}
+
+static void *guard_side(void *arg)
+{
+    int id = (int) (long) arg;
+    long n = 0;
+
+    while (!guard_stop) {
+        while (guard_turn != id && !guard_stop)
+            st_cond_wait(guard_cond[id]);
+        guard_turn = !id;
+        n++;
+        st_cond_signal(guard_cond[!id]);
+    }
+    st_cond_signal(guard_cond[!id]);
+    return (void*) n;
+}
+
+static void *guard_other_thread(void *arg)
+{
+    (void) arg;
+    while (!guard_stop) {
+        guard_other++;
+        st_thread_yield();
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int on = argc > 1 ? atoi(argv[1]) : 1;
+    st_thread_t t[2 * NPAIRS];
+    void *rounds;
+    double a, b;
+    int i;
+
+    st_runnext(on);
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+
+    for (i = 0; i < NPAIRS; i++) {
+        pairs[i].cond[0] = st_cond_new();
+        pairs[i].cond[1] = st_cond_new();
+        pairs[i].buf = (char*) calloc(1, BUFSIZE);
+    }
+    a = now();
+    for (i = 0; i < 2 * NPAIRS; i++)
+        t[i] = st_thread_create(pair_side, (void*) (long) i, 1, 0);
+    for (i = 0; i < 2 * NPAIRS; i++)
+        st_thread_join(t[i], NULL);
+    b = now();
+    printf("runnext %d: cond ping-pong %.0f ns/handoff\n", on, (b - a) * 1e9 / (2.0 * NPAIRS * NROUNDS));
+
+    lock = st_mutex_new();
+    a = now();
+    for (i = 0; i < NMUTEX; i++)
+        t[i] = st_thread_create(mutex_worker, NULL, 1, 0);
+    for (i = 0; i < NMUTEX; i++)
+        st_thread_join(t[i], NULL);
+    b = now();
+    printf("runnext %d: mutex handoff %.0f ns/acquire\n", on, (b - a) * 1e9 / (1.0 * NMUTEX * NROUNDS));
+
+    guard_cond[0] = st_cond_new();
+    guard_cond[1] = st_cond_new();
+    t[0] = st_thread_create(guard_side, (void*) 0, 1, 0);
+    t[1] = st_thread_create(guard_side, (void*) 1, 1, 0);
+    t[2] = st_thread_create(guard_other_thread, NULL, 1, 0);
+    for (i = 0; i < 100000; i++)
+        st_thread_yield();
+    guard_stop = 1;
+    st_thread_join(t[0], &rounds);
+    st_thread_join(t[1], NULL);
+    st_thread_join(t[2], NULL);
+    printf("runnext %d: ping-pong rounds %ld, yielding thread ran %ld times\n", on, (long) rounds, guard_other);
+
+    return 0;
+}
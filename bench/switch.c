@@ -0,0 +1,58 @@
+/*
+ * 上下文切换开销: 两个线程轮流让出 CPU，每次让出经过一次 _st_vp_switch(直接切换到另一个线程)
+ * 分别用汇编后端与 ucontext 后端编译，对比每次让出的耗时
+ *
+ *   cd bench && gcc -O2 -I.. ../[a-z]*.c ../md.S switch.c -o switch -lpthread && ./switch
+ *   cd bench && gcc -O2 -DST_SWITCH_UCONTEXT -I.. ../[a-z]*.c ../md.S switch.c -o switch_uc -lpthread && ./switch_uc
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define NYIELDS 2000000
+
+static long count = 0;
+
+/* 只做切换本身，不像 st_thread_yield 那样检查时钟 */
+static void yield(void)
+{
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+
+    me->state = _ST_ST_RUNNABLE;
+    _ST_ADD_RUNQ(me);
+    _ST_SWITCH_CONTEXT(me);
+}
+
+static void *worker(void *arg)
+{
+    int i;
+
+    (void) arg;
+    for (i = 0; i < NYIELDS; i++) {
+        count++;
+        yield();
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    st_utime_t t0, t1;
+
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+    st_thread_create(worker, NULL, 0, 0);
+    st_thread_create(worker, NULL, 0, 0);
+
+    t0 = st_utime();
+    while (count < 2L * NYIELDS)
+        yield();
+    t1 = st_utime();
+
+    printf("%s: %.1f ns per yield (%ld yields)\n", _ST_MD_NAME, (t1 - t0) * 1000.0 / count, count);
+    return 0;
+}
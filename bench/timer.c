@@ -0,0 +1,77 @@
+/*
+ * IO 超时的插入、取消开销: 1M 个 1s~60s 的超时同时存在，分别放入休眠堆与时间轮，测量插入、
+ * 取消后重新插入(IO 在超时前完成，下一次等待重新设置超时)以及取消的平均耗时
+ *
+ *   cd bench && gcc -O2 -I.. ../[a-z]*.c ../md.S timer.c -o timer -lpthread && ./timer
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#define NTIMERS 1000000
+#define NCHURN  3
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void add(_st_thread_t *thread, st_utime_t timeout, int wheel)
+{
+    if (wheel)
+        _st_add_io_timeout(thread, timeout);
+    else
+        _st_add_sleep_q(thread, timeout);
+}
+
+int main(void)
+{
+    _st_thread_t *threads;
+    st_utime_t *timeouts;
+    double a, b, c, d;
+    int wheel, r, i;
+
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+    threads = (_st_thread_t*) aligned_alloc(_ST_CACHE_LINE, sizeof(_st_thread_t) * NTIMERS);
+    timeouts = (st_utime_t*) malloc(sizeof(st_utime_t) * NTIMERS);
+    if (!threads || !timeouts) {
+        perror("malloc");
+        return 1;
+    }
+    memset(threads, 0, sizeof(_st_thread_t) * NTIMERS);
+    srandom(1);
+    for (i = 0; i < NTIMERS; i++)
+        timeouts[i] = 1000000 + random() % 59000000;
+
+    for (wheel = 0; wheel < 2; wheel++) {
+        a = now_ns();
+        for (i = 0; i < NTIMERS; i++)
+            add(&threads[i], timeouts[i], wheel);
+        b = now_ns();
+        for (r = 0; r < NCHURN; r++) {
+            for (i = 0; i < NTIMERS; i++) {
+                _st_del_sleep_q(&threads[i]);
+                add(&threads[i], timeouts[i], wheel);
+            }
+        }
+        c = now_ns();
+        for (i = 0; i < NTIMERS; i++)
+            _st_del_sleep_q(&threads[i]);
+        d = now_ns();
+
+        printf("%s: insert %.1f ns, cancel+reinsert %.1f ns, cancel %.1f ns\n", wheel ? "wheel" : "heap ",
+               (b - a) / NTIMERS, (c - b) / ((double) NCHURN * NTIMERS), (d - c) / NTIMERS);
+    }
+
+    return 0;
+}
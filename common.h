@@ -11,6 +11,59 @@
 #define ST_BEGIN_MACRO {
 #define ST_END_MACRO }
 
+#include "md.h"
+
+/* cache line 大小，线程对象等热点数据按它对齐 */
+#ifndef _ST_CACHE_LINE
+#define _ST_CACHE_LINE 64
+#endif
+
+/*
+ * 每个 vp 一份的运行时状态(vp，当前线程，栈缓存，事件系统数据等)放在线程局部存储中，每个 OS 线程
+ * 运行一个独立的 vp。使用 initial-exec 模型，访问时只需要一次相对线程指针的寻址
+ */
+#define _ST_TLS __thread __attribute__((tls_model("initial-exec")))
+
+/*
+ * 时间轮: 每个 tick ST_TIMER_WHEEL_TICK 微秒，第 0 层 256 个槽位，其余 3 层各 64 个槽位，
+ * 可以覆盖 2^26 个 tick(1ms 的 tick 约 18.6 小时)，更长的超时到期前会在最高层重新放置
+ * 不短于 ST_TIMER_WHEEL_MIN 的 IO 超时进入时间轮，其余的超时(包括 sleep 与条件变量)使用休眠堆
+ */
+#ifndef ST_TIMER_WHEEL_TICK
+#define ST_TIMER_WHEEL_TICK 1000
+#endif
+
+#ifndef ST_TIMER_WHEEL_MIN
+#define ST_TIMER_WHEEL_MIN (10 * 1000)
+#endif
+
+/* 每个 vp 可被窃取的线程队列长度，必须是 2 的幂 */
+#ifndef ST_STEAL_RING_SIZE
+#define ST_STEAL_RING_SIZE 256
+#endif
+
+/* 参与 work stealing 的 vp 个数上限 */
+#ifndef ST_MAX_VPS
+#define ST_MAX_VPS 64
+#endif
+
+/* runnext 最多连续运行的次数，超过后让可运行队列中的其他线程先运行 */
+#ifndef ST_RUNNEXT_MAX
+#define ST_RUNNEXT_MAX 16
+#endif
+
+/* 开启 work stealing 时，空闲 vp 在 epoll_wait 中最多等待的毫秒数，之后重新尝试窃取 */
+#ifndef ST_STEAL_POLL_MSECS
+#define ST_STEAL_POLL_MSECS 1
+#endif
+
+/* 预取，用于提前加载下一个要运行的线程 */
+#if defined(__GNUC__)
+#define _ST_PREFETCH(_addr) __builtin_prefetch(_addr)
+#else
+#define _ST_PREFETCH(_addr) ((void)0)
+#endif
+
 /* 注意，所有不在 public.h 文件中的 struct，函数都是 _ 开头的 */
 /* 代表其是内部使用的，并不对外暴露，提供给调用者的接口仅为 public.h */
 
@@ -76,14 +129,24 @@ typedef struct _st_clist {
 
 typedef void (*_st_destructor_t)(void *);
 
+struct _st_thread;
+
 typedef struct _st_stack {
   _st_clist_t links;
+  struct _st_thread *owner; /* 共享运行栈当前的占用者，栈上保存的是它的数据 */
   char *vaddr;      /* 栈占用的虚拟内存的开始字节 */
   int vaddr_size;   /* 栈占用的虚拟内存总量 */
   int stk_size;     /* 栈容量 */
   char *stk_bottom; /* 栈底部 */
   char *stk_top;    /* 栈顶 */
-  void *sp;         /* 栈指针 */
+  void *sp;         /* 初始栈指针，之上是线程对象与线程私有数据 */
+  int committed;    /* 弹性栈从 stk_top 向下已经提交(可读写)的字节数，0 表示不是弹性栈 */
+  int painted;      /* 栈是否已经染色，用于测量栈的最大使用量 */
+  int trimmed;      /* 空闲期间是否已经释放了物理内存 */
+  int arena;        /* 栈从 arena 中切分而来，不能单独 munmap */
+  st_utime_t free_time; /* 放入空闲链表的时间 */
+  struct _st_stack *elastic_next;   /* 弹性栈在所属 vp 的链表中的后继与前驱的 next 指针 */
+  struct _st_stack **elastic_prev;  /* 不在链表中时为 NULL */
 } _st_stack_t;
 
 /*****************************************
@@ -99,31 +162,56 @@ typedef struct _st_cond {
  */
 typedef struct _st_thread _st_thread_t;
 
+/*
+ * 字段按访问频率排列: 调度时(出入可运行队列，上下文切换，IO/条件变量唤醒)只会访问第一个 cache line
+ * 中的字段，休眠堆相关的字段次之，其余字段只在线程创建、退出时使用。线程对象本身按 cache line 对齐
+ */
 struct _st_thread {
+  /* 热字段，第一个 cache line */
   int state; /* 线程状态 */
   int flags; /* 线程 flags */
 
-  void *(*start)(void *arg); /* 线程的 start 函数 */
-  void *arg;                 /* start 函数的启动参数 */
-  void *retval;              /* 线程 start 函数的返回结果 */
-
-  _st_stack_t *stack; /* 线程执行栈 */
-
   _st_clist_t links;      /* run/sleep/zombie 队列指针 */
+  _st_stack_t *stack;     /* 线程执行栈 */
+#ifndef ST_SWITCH_UCONTEXT
+  _st_context_t context;  /* 线程上下文，源代码使用的是 jmp_buf，见 md.h */
+#endif
   _st_clist_t wait_links; /* mutex/condvar 等待队列指针 */
 
+  /* 休眠堆与时间轮 */
   st_utime_t due;      /* 线程的 sleep 结束时间 */
   _st_thread_t *left;  /* 超时堆 */
   _st_thread_t *right; /* -- see docs/timeout_heap.txt for details */
   int heap_index;
+  _st_clist_t timer_links; /* 时间轮槽位链表指针 */
+  st_utime_t slack;        /* 超时允许推迟的微秒数，ST_TIMER_SLACK_DEFAULT 表示使用全局设置 */
+  st_utime_t deadline;     /* 被 slack 推迟对齐前的截止时间 */
+
+  /* 运行预算，见 st_thread_budget */
+  st_utime_t budget;      /* 每次被调度后允许连续运行的微秒数，0 表示不限制 */
+  st_utime_t slice_start; /* 本次被调度的时间，只在设置了 budget 时记录 */
+
+  /* 冷字段 */
+  void *(*start)(void *arg); /* 线程的 start 函数 */
+  void *arg;                 /* start 函数的启动参数 */
+  void *retval;              /* 线程 start 函数的返回结果 */
 
   void **private_data; /* 线程私有数据 */
 
   _st_cond_t *term; /* 线程结束时，join 使用的条件变量 */
 
-  ucontext_t
-      context; /* 线程上下文，源代码使用的是 jum_buf，我们使用 ucontext */
-};
+  struct _st_steal_ring *lender; /* 被窃取过的线程，创建它的 vp 的 steal_ring，结束时归还计数 */
+
+  /* 共享栈线程(_ST_FL_SHARED_STACK)被挤出运行栈时，用到的栈数据保存在这里 */
+  char *save_buf; /* 保存栈数据的堆内存 */
+  int save_size;  /* 保存的字节数，即 [context.sp, stk_top) */
+  int save_cap;   /* save_buf 的容量 */
+  int stk_size;   /* 创建时申请的栈大小，用于统计节省的内存 */
+
+#ifdef ST_SWITCH_UCONTEXT
+  _st_context_t context; /* ucontext_t 有将近 1K，放在最后以免把其他字段挤出热 cache line */
+#endif
+} __attribute__((aligned(_ST_CACHE_LINE)));
 
 /*****************************************
  * 互斥锁
@@ -136,43 +224,100 @@ typedef struct _st_mutex {
 /*****************************************
  * poll 队列
  */
+struct _st_pollq;
+
+/* pollq 中每个 pollfd 一个，挂在事件系统中该描述符的等待链表上，事件到达时只需要检查等待它的 pollq */
+typedef struct _st_pollwait {
+  struct _st_pollwait *next;
+  struct _st_pollwait **pprev; /* 指向前一个节点的 next 或者链表头 */
+  struct _st_pollq *pq;
+  void *data;                  /* 事件系统的私有数据，io_uring 用来记录提交的 poll 请求 */
+} _st_pollwait_t;
+
 typedef struct _st_pollq {
   _st_clist_t links;    /* io 队列指针 */
   _st_thread_t *thread; /* 正在执行 polling 的 thread */
   struct pollfd *pds;   /* polling 的描述符数组 */
   int npds;             /* 数组长度 */
   int on_ioq;           /* Is it on ioq? */
+  _st_pollwait_t *waits; /* npds 个等待节点，由事件系统使用 */
 } _st_pollq_t;
 
+/* st_poll 在栈上为这么多个描述符准备等待节点，超过时从堆上分配 */
+#ifndef ST_POLL_STACK_WAITS
+#define ST_POLL_STACK_WAITS 8
+#endif
+
 /*****************************************
- * 事件系统，可以理解为一个接口类，我们后面只会实现 epoll 的代码
+ * 事件系统，可以理解为一个接口类，实现了 epoll 与 io_uring，见 st_set_eventsys
  */
+
+/* 交给事件系统直接完成的 IO 操作，见 _st_eventsys_t 的 io */
+#define _ST_IO_READ    0
+#define _ST_IO_WRITE   1
+#define _ST_IO_ACCEPT  2  /* buf 为地址，arg 为地址长度的指针 */
+#define _ST_IO_CONNECT 3  /* buf 为地址，len 为地址长度 */
+
 typedef struct _st_eventsys_ops {
   const char *name;                           /* 事件系统的名字 */
   int (*init)(void);                          /* 初始化 */
-  void (*dispatch)(void);                     /* dispatch 用于分发事件 */
-  int (*pollset_add)(struct pollfd *, int);   /* 添加一组描述符 */
-  void (*pollset_del)(struct pollfd *, int);  /* 删除一组描述符 */
+  void (*dispatch)(int);                      /* dispatch 用于分发事件，参数为 0 时不等待 */
+  int (*pollset_add)(_st_pollq_t *);          /* 添加 pollq 中的描述符，返回正数表示已经有描述符就绪，没有添加 */
+  void (*pollset_del)(_st_pollq_t *);         /* 删除 pollq 中的描述符 */
   int (*fd_new)(int);                         /* 向事件系统添加一个文件描述符 */
   int (*fd_close)(int);                       /* 关闭某文件描述 */
   int (*fd_getlimit)(void);                   /* 文件描述符的上限 */
+  int (*netfd_add)(struct _st_netfd *);       /* 以边沿触发方式持久注册 netfd */
+  void (*netfd_del)(struct _st_netfd *);      /* 取消 netfd 的持久注册 */
+  /*
+   * 由事件系统完成一次 IO 操作，线程挂起直到操作完成，不需要先等待就绪。参数依次为操作(_ST_IO_READ 等)、
+   * 描述符、buf、len、arg 与超时。不支持时为 NULL，返回 -1 并且 errno 为 EAGAIN 时按就绪通知的方式重试
+   */
+  ssize_t (*io)(int, int, void *, size_t, void *, st_utime_t);
 } _st_eventsys_t;
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define _ST_HAVE_IO_URING
+extern _st_eventsys_t _st_uring_eventsys;
+int _st_uring_probe(void);
+#endif
+#endif
+
+/*****************************************
+ * 可被其他 vp 窃取的可运行线程环形队列，参考 Go 的 runq 实现
+ * 只有所属 vp 会写入(推进 tail)，所属 vp 与窃取者都通过 CAS 推进 head 来取出线程
+ */
+typedef struct _st_steal_ring {
+  unsigned int head;                                    /* 消费端 */
+  unsigned int tail __attribute__((aligned(_ST_CACHE_LINE))); /* 生产端，只有所属 vp 写 */
+  _st_thread_t *buf[ST_STEAL_RING_SIZE];
+  int lent __attribute__((aligned(_ST_CACHE_LINE)));    /* 被其他 vp 窃取走、还没有结束的线程数 */
+} _st_steal_ring_t;
+
 /*****************************************
  * virtual processor
  */
 typedef struct _st_vp {
+  /* 调度与事件分发时访问的字段放在一个 cache line 中 */
+  _st_clist_t run_q;         /* 处于可运行态的线程队列 */
+  _st_clist_t io_q;          /* 等待 IO 事件的线程队列 */
+  _st_thread_t *sleep_q;     /* 休眠线程堆 */
   _st_thread_t *idle_thread; /* Idle thread */
   st_utime_t last_clock;     /* 最后一次调用 vp_check_clock() 时间 */
-
-  _st_clist_t run_q;    /* 处于可运行态的线程队列 */
-  _st_clist_t io_q;     /* 等待 IO 事件的线程队列 */
-  _st_clist_t zombie_q; /* 僵尸线程队列 */
+  int sleepq_size;           /* 休眠线程数 */
   int pagesize;
 
-  _st_thread_t *sleep_q; /* 休眠线程堆 */
-  int sleepq_size;       /* 休眠线程数 */
-} _st_vp_t;
+  _st_thread_t *runnext; /* 被唤醒后插在可运行队列头部、下一个运行的线程，见 st_runnext */
+  int runnext_streak;     /* 连续从 runnext 取线程的次数 */
+
+  _st_clist_t zombie_q; /* 僵尸线程队列 */
+  int id;               /* vp 编号，调用 st_init 的第一个 vp 为 0 */
+  _st_steal_ring_t *steal_ring; /* 可被窃取的新线程，开启 work stealing 时使用 */
+  unsigned int schedtick;       /* 调度计数，用于保证 steal_ring 中的线程不会饿死 */
+  unsigned int poll_tick;       /* 上次轮询 IO 之后的切换次数 */
+  st_utime_t last_poll;         /* 上次轮询 IO 的时间 */
+} __attribute__((aligned(_ST_CACHE_LINE))) _st_vp_t;
 
 /*****************************************
  * 文件描述符的额外封装
@@ -184,15 +329,48 @@ typedef struct _st_netfd {
   _st_destructor_t destructor; /* 私有数据的析构函数 */
   void *aux_data;         /* 辅助数据，用于实现 serialize accept */
   struct _st_netfd *next; /* 用单链表组织该资源 */
+
+  /* 边沿触发模式，见 st_edge_triggered */
+  int et;              /* 是否以边沿触发的方式持久注册在事件系统中 */
+  int ready;           /* 可能就绪的事件(POLLIN/POLLOUT/POLLPRI)，由事件系统设置，遇到 EAGAIN 时清除 */
+  _st_clist_t wait_q;  /* 等待该描述符的 pollq */
+  _st_vp_t *vp;        /* 注册在哪个 vp 的事件系统中，其他 vp 上的线程等待时退回到 st_poll */
+  int stream;          /* 是否为 SOCK_STREAM，这时读到的比请求的少说明接收缓冲区已经读空 */
 } _st_netfd_t;
 
+/* netfd 的 ready 中记录出错或者对端关闭的位，之后读写都不会阻塞，不会因为短读被清除 */
+#define _ST_READY_HUP 0x10000
+
 /*****************************************
  * Current vp, thread, and event system
+ * vp 与当前线程是每个 OS 线程一份的，事件系统的实现是进程共享的，但其数据也是每个 vp 一份
  */
-extern _st_vp_t _st_this_vp;
-extern _st_thread_t *_st_this_thread;
+extern _ST_TLS _st_vp_t _st_this_vp;
+extern _ST_TLS _st_thread_t *_st_this_thread;
+extern _ST_TLS int _st_active_count;
 extern _st_eventsys_t *_st_eventsys;
 
+/* work stealing 相关，见 sched.c */
+extern int _st_work_stealing;
+extern int _st_steal_nrings;
+void _st_steal_refill(void);
+int _st_steal(void);
+
+/*
+ * 在从可运行队列取线程之前调用。可运行队列为空时，或者每隔 61 次调度(与 Go 一样取一个素数)，
+ * 把 steal_ring 中的一个线程移到可运行队列头部
+ */
+#define _ST_STEAL_REFILL()                                                          \
+  ST_BEGIN_MACRO                                                                    \
+  if (_st_work_stealing && _st_this_vp.steal_ring &&                                \
+      (ST_CLIST_IS_EMPTY(&_st_this_vp.run_q) || ++_st_this_vp.schedtick % 61 == 0)) \
+    _st_steal_refill();                                                             \
+  ST_END_MACRO
+
+/* 当前 vp 创建、被其他 vp 窃取后还没有结束的线程数，不为 0 时 vp 不能结束，也不能无限期地阻塞等待 IO */
+#define _ST_VP_LENT() \
+  (_st_this_vp.steal_ring ? __atomic_load_n(&_st_this_vp.steal_ring->lent, __ATOMIC_ACQUIRE) : 0)
+
 #define _ST_CURRENT_THREAD() (_st_this_thread)
 #define _ST_SET_CURRENT_THREAD(_thread) (_st_this_thread = (_thread))
 
@@ -207,7 +385,25 @@ extern _st_eventsys_t *_st_eventsys;
 #define _ST_SLEEPQ (_st_this_vp.sleep_q)
 #define _ST_SLEEPQ_SIZE (_st_this_vp.sleepq_size)
 
-#define _ST_VP_IDLE() (*_st_eventsys->dispatch)()
+#define _ST_VP_IDLE() (*_st_eventsys->dispatch)(1)
+
+/* busy poll 相关，见 event.c */
+extern st_utime_t _st_busy_poll_usecs;
+extern int _st_busy_poll_flags;
+
+/* 强制轮询相关，见 st_set_poll_interval */
+extern int _st_poll_forced;
+void _st_vp_poll(void);
+
+/*
+ * 在从可运行队列取线程之前调用。开启强制轮询后，每隔一定的切换次数或者时间，即使可运行队列不为空，
+ * 也不阻塞地收集一次 IO 事件并检查超时，避免 CPU 满载时 IO 与超时长时间得不到处理
+ */
+#define _ST_POLL_CHECK()  \
+  ST_BEGIN_MACRO          \
+  if (_st_poll_forced)    \
+    _st_vp_poll();        \
+  ST_END_MACRO
 
 /*****************************************
  * virtual processor 队列相关操作
@@ -218,8 +414,21 @@ extern _st_eventsys_t *_st_eventsys;
 #define _ST_ADD_RUNQ(_thr) ST_APPEND_LINK(&(_thr)->links, &_ST_RUNQ)
 #define _ST_DEL_RUNQ(_thr) ST_REMOVE_LINK(&(_thr)->links)
 
+/* 唤醒等待者，开启 runnext 时让它紧接着当前线程运行，否则排到可运行队列末尾 */
+extern int _st_runnext;
+void _st_add_runnext(_st_thread_t *thread);
+#define _ST_ADD_RUNNEXT(_thr)   \
+  ST_BEGIN_MACRO                \
+  if (_st_runnext)              \
+    _st_add_runnext(_thr);      \
+  else                          \
+    _ST_ADD_RUNQ(_thr);         \
+  ST_END_MACRO
+
 #define _ST_ADD_SLEEPQ(_thr, _timeout) _st_add_sleep_q(_thr, _timeout)
 #define _ST_DEL_SLEEPQ(_thr) _st_del_sleep_q(_thr)
+/* IO 超时，较长的超时放入时间轮，删除同样使用 _ST_DEL_SLEEPQ */
+#define _ST_ADD_IO_TIMEOUT(_thr, _timeout) _st_add_io_timeout(_thr, _timeout)
 
 #define _ST_ADD_ZOMBIEQ(_thr) ST_APPEND_LINK(&(_thr)->links, &_ST_ZOMBIEQ)
 #define _ST_DEL_ZOMBIEQ(_thr) ST_REMOVE_LINK(&(_thr)->links)
@@ -255,6 +464,16 @@ extern _st_eventsys_t *_st_eventsys;
 #define _ST_FL_INTERRUPT 0x08
 /* 等待超时 */
 #define _ST_FL_TIMEDOUT 0x10
+/* 运行在共享栈上，换出后栈数据可能被拷贝到 save_buf */
+#define _ST_FL_SHARED_STACK 0x20
+/* 超时在时间轮而不是休眠堆中，总是与 _ST_FL_ON_SLEEPQ 一起设置 */
+#define _ST_FL_ON_WHEEL 0x40
+/* 超时时间因为 timer slack 被推迟对齐过，用于统计节省的唤醒次数 */
+#define _ST_FL_COALESCED 0x80
+/* 设置了运行预算，被调度时需要记录时间 */
+#define _ST_FL_BUDGET 0x100
+/* 正在退出，栈已经交还，只剩最后一次切换 */
+#define _ST_FL_EXITING 0x200
 
 /*****************************************
  * 指针转型，因为 clist 使用的类似嵌套结构体的方式，我们需要可以用一个 clist
@@ -287,6 +506,65 @@ extern _st_eventsys_t *_st_eventsys;
 
 #define ST_DEFAULT_STACK_SIZE (128 * 1024) /* Includes register stack size */
 
+/*
+ * 栈 size class 覆盖的 2 的幂的个数，最大的 class 是 (pagesize << (ST_STACK_CLASSES - 1))，更大的栈单独管理
+ * 每个 2 的幂区间又细分为 4 个 class，见 stk.c
+ */
+#ifndef ST_STACK_CLASSES
+#define ST_STACK_CLASSES 12
+#endif
+
+/* 每个栈 arena 的大小，不足一个栈时按一个栈计算 */
+#ifndef ST_STACK_ARENA_SIZE
+#define ST_STACK_ARENA_SIZE (4 * 1024 * 1024)
+#endif
+
+/* 释放空闲栈物理内存时使用的 madvise 参数，MADV_FREE 更便宜但 RSS 只在内存紧张时才会下降 */
+#ifndef ST_STACK_TRIM_ADVICE
+#define ST_STACK_TRIM_ADVICE MADV_DONTNEED
+#endif
+
+/* 共享运行栈的个数与大小，共享栈线程按创建顺序轮流分配到这些运行栈上 */
+#ifndef ST_SHARED_STACK_COUNT
+#define ST_SHARED_STACK_COUNT 4
+#endif
+
+#ifndef ST_SHARED_STACK_SIZE
+#define ST_SHARED_STACK_SIZE ST_DEFAULT_STACK_SIZE
+#endif
+
+/* 弹性栈预留的虚拟地址空间大小，以及初始提交的大小 */
+#ifndef ST_ELASTIC_STACK_RESERVE
+#define ST_ELASTIC_STACK_RESERVE (8 * 1024 * 1024)
+#endif
+
+#ifndef ST_ELASTIC_STACK_INIT
+#define ST_ELASTIC_STACK_INIT (16 * 1024)
+#endif
+
+/* 处理弹性栈增长的 SIGSEGV handler 使用的信号栈大小 */
+#ifndef ST_SIGALTSTACK_SIZE
+#define ST_SIGALTSTACK_SIZE (64 * 1024)
+#endif
+
+/* 调度器上下文的栈大小，栈底另有一个保护页 */
+#ifndef ST_SCHED_STACK_SIZE
+#define ST_SCHED_STACK_SIZE (64 * 1024)
+#endif
+
+/* 栈大小自动调整: 按 start 函数记录的槽位数，每个函数采样的次数，以及在峰值上额外预留的百分比 */
+#ifndef ST_STACK_AUTOTUNE_SLOTS
+#define ST_STACK_AUTOTUNE_SLOTS 64
+#endif
+
+#ifndef ST_STACK_AUTOTUNE_SAMPLES
+#define ST_STACK_AUTOTUNE_SAMPLES 16
+#endif
+
+#ifndef ST_STACK_AUTOTUNE_MARGIN
+#define ST_STACK_AUTOTUNE_MARGIN 50
+#endif
+
 #ifndef ST_KEYS_MAX
 #define ST_KEYS_MAX 16
 #endif
@@ -296,41 +574,46 @@ extern _st_eventsys_t *_st_eventsys;
 #endif
 
 /*****************************************
- * 线程上下文切换，这里是重点，我们改为使用
- * ucontext，移植性不足，但是可以避免汇编 我们删除了一些 debug 使用的 hook (比如
- * switch in/out callback)
+ * 线程上下文切换，这里是重点。默认使用 md.S 中只保存 callee-saved 寄存器的汇编实现，
+ * 定义 ST_SWITCH_UCONTEXT 时回退到 ucontext，见 md.h
+ * 我们删除了一些 debug 使用的 hook (比如 switch in/out callback)
  */
 
 /* scheduler routine 使用的上下文 */
-extern ucontext_t _st_schedule_context;
+extern _ST_TLS _st_context_t _st_schedule_context;
 
 /*
- * 换出当前线程，进入调度器
+ * 换出当前线程。可运行队列不为空时直接切换到下一个线程，只有需要执行 idle 线程时才进入调度器，
+ * 见 _st_vp_switch
  */
-#define _ST_SWITCH_CONTEXT(_thread)                  \
-  ST_BEGIN_MACRO                                     \
-  swapcontext(&(_thread)->context, &_st_schedule_context); \
-  ST_END_MACRO
+#define _ST_SWITCH_CONTEXT(_thread) _st_vp_switch(_thread)
 
 /*
  * 恢复之前保存的一个线程的上下文
  */
-#define _ST_RESTORE_CONTEXT(_thread) \
-  ST_BEGIN_MACRO                     \
-  _ST_SET_CURRENT_THREAD(_thread);   \
-  swapcontext(&_st_schedule_context, &(_thread)->context); \
+#define _ST_RESTORE_CONTEXT(_thread)                         \
+  ST_BEGIN_MACRO                                             \
+  _ST_SET_CURRENT_THREAD(_thread);                           \
+  _ST_MD_SWAP(&_st_schedule_context, &(_thread)->context);   \
+  ST_END_MACRO
+
+/*
+ * 线程被调度执行，设置了运行预算的线程开始新的时间片
+ */
+#define _ST_SLICE_START(_thread)                \
+  ST_BEGIN_MACRO                                \
+  if ((_thread)->flags & _ST_FL_BUDGET)         \
+    (_thread)->slice_start = st_utime();        \
   ST_END_MACRO
 
 /*
  * 初始化线程上下文
  */
-#define _ST_INIT_CONTEXT(_thread, _main)                                                    \
-  ST_BEGIN_MACRO                                                                            \
-  getcontext(&(_thread)->context);                                                          \
-  (_thread)->context.uc_stack.ss_sp = (_thread)->stack->sp;                                 \
-  (_thread)->context.uc_stack.ss_size = (_thread)->stack->stk_top - (char*)(_thread)->stack->sp; \
-  (_thread)->context.uc_link = &_st_schedule_context;                                             \
-  makecontext(&(_thread)->context, _main, 0);                                               \
+#define _ST_INIT_CONTEXT(_thread, _main)                                  \
+  ST_BEGIN_MACRO                                                          \
+  _ST_MD_INIT(&(_thread)->context, (_thread)->stack->stk_bottom,          \
+              (char *)(_thread)->stack->sp - (_thread)->stack->stk_bottom, \
+              _main, &_st_schedule_context);                              \
   ST_END_MACRO
 
 /*****************************************
@@ -338,15 +621,31 @@ extern ucontext_t _st_schedule_context;
  */
 
 void _st_vp_schedule(void);
+void _st_vp_switch(_st_thread_t *me);
 void _st_vp_check_clock(void);
 void *_st_idle_thread_start(void *arg);
 void _st_thread_main(void);
 void _st_thread_cleanup(_st_thread_t *thread);
 void _st_add_sleep_q(_st_thread_t *thread, st_utime_t timeout);
+void _st_add_io_timeout(_st_thread_t *thread, st_utime_t timeout);
 void _st_del_sleep_q(_st_thread_t *thread);
+st_utime_t _st_sleep_next_due(void);
 _st_stack_t *_st_stack_new(int stack_size);
 void _st_stack_free(_st_stack_t *ts);
+void _st_stack_trim(st_utime_t now, _st_stack_t *keep);
+void _st_stack_bind(_st_stack_t *ts);
+st_utime_t _st_stack_trim_due(void);
+int _st_stack_vp_init(void);
+int _st_stack_paint_needed(void *key);
+void _st_stack_paint(_st_stack_t *ts);
+int _st_stack_peak(_st_stack_t *ts);
+int _st_stack_autotune_size(void *key);
+void _st_stack_autotune_record(void *key, _st_stack_t *ts);
+_st_thread_t *_st_shared_thread_new(int stk_size);
+void _st_shared_thread_free(_st_thread_t *thread);
+int _st_shared_stack_swap_in(_st_thread_t *thread);
 int _st_io_init(void);
+int _st_netfd_persist(_st_netfd_t *fd);
 
 st_utime_t st_utime(void);
 _st_cond_t *st_cond_new(void);
@@ -358,4 +657,6 @@ ssize_t st_write(_st_netfd_t *fd, const void *buf, size_t nbyte,
                  st_utime_t timeout);
 int st_poll(struct pollfd *pds, int npds, st_utime_t timeout);
 _st_thread_t *st_thread_create(void *(*start)(void *arg), void *arg,
-                               int joinable, int stk_size);
\ No newline at end of file
+                               int joinable, int stk_size);
+_st_thread_t *st_thread_create_ex(void *(*start)(void *arg), void *arg,
+                                  int joinable, int stk_size, int flags);
\ No newline at end of file
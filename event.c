@@ -8,6 +8,10 @@
 */
 
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
@@ -22,9 +26,11 @@ typedef struct _epoll_fd_data {
     int wr_ref_cnt;     /* 写事件引用计数 */
     int ex_ref_cnt;     /* except 引用计数 */
     int revents;        /* 触发的事件 */
+    _st_pollwait_t *waiters; /* 等待该描述符的 pollq，dispatch 只需要检查就绪描述符上的等待者 */
+    _st_netfd_t *netfd; /* 以边沿触发方式持久注册的 netfd，不再需要按引用计数修改注册的事件 */
 } _epoll_fd_data_t;
 
-static struct _st_epolldata {
+static _ST_TLS struct _st_epolldata {
     _epoll_fd_data_t *fd_data;      /* 文件描述符数组 */
     struct epoll_event *evtlist;    /* epoll 触发事件数组 */
     int fd_data_size;               /* 文件描述数组长度 */
@@ -32,8 +38,33 @@ static struct _st_epolldata {
     int evtlist_cnt;                /* epoll 触发事件数 */
     int fd_hint;                    /* 创建 epoll 的 hint */
     int epfd;                       /* epoll 的句柄 */
+    int timerfd;                    /* 不支持 epoll_pwait2 时用于亚毫秒超时的 timerfd，按需创建 */
+    int busy_poll_set;              /* 是否已经对 epfd 设置了内核的 busy poll 参数 */
+    st_utime_t spin_window;         /* 阻塞之前自旋轮询的微秒数，根据最近的自旋是否有收获调整 */
     pid_t pid;                      /* 进程 id */
-} *_st_epoll_data;
+} *_st_epoll_data;                 /* 每个 vp 有自己的 epoll 实例 */
+
+#ifndef __NR_epoll_pwait2
+    #define __NR_epoll_pwait2 441
+#endif
+
+/* 内核是否支持 epoll_pwait2(5.11+)，第一次返回 ENOSYS 后所有 vp 都改用 timerfd */
+static int _st_epoll_pwait2_ok = 1;
+
+/* busy poll 设置，见 st_set_busy_poll */
+st_utime_t _st_busy_poll_usecs = 0;
+int _st_busy_poll_flags = 0;
+
+/* 内核 6.9 开始支持对 epoll 实例设置 busy poll 参数 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
 
 #ifndef ST_EPOLL_EVTLIST_SIZE
     /* Not a limit, just a hint */
@@ -45,6 +76,7 @@ static struct _st_epolldata {
 #define _ST_EPOLL_WRITE_CNT(fd)  (_st_epoll_data->fd_data[fd].wr_ref_cnt)
 #define _ST_EPOLL_EXCEP_CNT(fd)  (_st_epoll_data->fd_data[fd].ex_ref_cnt)
 #define _ST_EPOLL_REVENTS(fd)    (_st_epoll_data->fd_data[fd].revents)
+#define _ST_EPOLL_NETFD(fd)      _st_epoll_netfd(fd)
 
 #define _ST_EPOLL_READ_BIT(fd)   (_ST_EPOLL_READ_CNT(fd) ? EPOLLIN : 0)
 #define _ST_EPOLL_WRITE_BIT(fd)  (_ST_EPOLL_WRITE_CNT(fd) ? EPOLLOUT : 0)
@@ -52,6 +84,22 @@ static struct _st_epolldata {
 #define _ST_EPOLL_EVENTS(fd) \
     (_ST_EPOLL_READ_BIT(fd)|_ST_EPOLL_WRITE_BIT(fd)|_ST_EPOLL_EXCEP_BIT(fd))
 
+/*
+ * 取出以边沿触发方式注册在 fd 上的 netfd。netfd 在其他 vp 上被释放时只会清除 et，
+ * 这里发现后清理掉过期的记录(关闭描述符时内核已经把它从 epoll 中删除了)
+ */
+static inline _st_netfd_t *_st_epoll_netfd(int fd)
+{
+    _st_netfd_t *netfd = _st_epoll_data->fd_data[fd].netfd;
+
+    if (netfd && (!netfd->et || netfd->osfd != fd || netfd->vp != &_st_this_vp)) {
+        _st_epoll_data->fd_data[fd].netfd = NULL;
+        _st_epoll_data->evtlist_cnt--;
+        netfd = NULL;
+    }
+    return netfd;
+}
+
 /* epoll 相关事件接口 */
 
 /* 初始化 */
@@ -64,6 +112,7 @@ static int _st_epoll_init(void)
     _st_epoll_data = (struct _st_epolldata *) calloc(1, sizeof(*_st_epoll_data));
     if (!_st_epoll_data)
         return -1;
+    _st_epoll_data->timerfd = -1;
 
     // 这个 hint 其实不是必须的，简单的使用 0 也是 ok 的
     fdlim = st_getfdlimit();
@@ -115,6 +164,7 @@ static int _st_epoll_fd_data_expand(int maxfd)
 {
     _epoll_fd_data_t *ptr;
     int n = _st_epoll_data->fd_data_size;
+    int i;
 
     /* 确定扩容目标大小 */
     while (maxfd >= n)
@@ -127,6 +177,12 @@ static int _st_epoll_fd_data_expand(int maxfd)
 
     memset(ptr + _st_epoll_data->fd_data_size, 0, (n - _st_epoll_data->fd_data_size) * sizeof(_epoll_fd_data_t));
 
+    /* 数组搬家以后，等待链表的第一个节点要指向新的链表头 */
+    for (i = 0; i < _st_epoll_data->fd_data_size; i++) {
+        if (ptr[i].waiters)
+            ptr[i].waiters->pprev = &ptr[i].waiters;
+    }
+
     /* 更新数组指针的大小 */
     _st_epoll_data->fd_data = ptr;
     _st_epoll_data->fd_data_size = n;
@@ -151,7 +207,7 @@ static void _st_epoll_evtlist_expand(void)
 }
 
 /* 删除描述符数组 */
-static void _st_epoll_pollset_del(struct pollfd *pds, int npds) {
+static void _st_epoll_pds_del(struct pollfd *pds, int npds) {
     struct epoll_event ev;
     struct pollfd *pd;
     struct pollfd *epd = pds + npds;
@@ -175,9 +231,9 @@ static void _st_epoll_pollset_del(struct pollfd *pds, int npds) {
         events = _ST_EPOLL_EVENTS(pd->fd);
         /*
          * 注意这里只有当 fd 上没有任何已触发事件的情况下才会去删除，这是为了这个函数可以在
-         * dispatch 内部被调用
+         * dispatch 内部被调用。边沿触发的 netfd 一直保持注册
          */
-        if (events != old_events && _ST_EPOLL_REVENTS(pd->fd) == 0) {
+        if (events != old_events && _ST_EPOLL_REVENTS(pd->fd) == 0 && !_ST_EPOLL_NETFD(pd->fd)) {
             /* 如果 events 已经为 0，那么删除否则则是修改 */
             op = events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
             /* 调用 epoll 对其进行修改或删除,同时修改相应计数字段 */
@@ -191,7 +247,7 @@ static void _st_epoll_pollset_del(struct pollfd *pds, int npds) {
 }
 
 /* 添加描述符数组 */
-static int _st_epoll_pollset_add(struct pollfd *pds, int npds) {
+static int _st_epoll_pds_add(struct pollfd *pds, int npds) {
     struct epoll_event ev;
     int i, fd;
     int old_events, events, op;
@@ -209,6 +265,25 @@ static int _st_epoll_pollset_add(struct pollfd *pds, int npds) {
             return -1;
     }
 
+    /*
+     * 边沿触发的 netfd 已经就绪时不会再有新的事件，它的 ready 表示可能就绪，这时用 poll 确认一次，
+     * 就绪的话直接返回，没有就绪的话之后的数据到达一定会触发新的事件
+     */
+    for (i = 0; i < npds; i++) {
+        fd = pds[i].fd;
+        if (_ST_EPOLL_NETFD(fd) && (_ST_EPOLL_NETFD(fd)->ready & pds[i].events))
+            break;
+    }
+    if (i < npds) {
+        int n = poll(pds, npds, 0);
+        if (n != 0)
+            return n;
+        for (i = 0; i < npds; i++) {
+            if (_ST_EPOLL_NETFD(pds[i].fd))
+                _ST_EPOLL_NETFD(pds[i].fd)->ready &= ~pds[i].events;
+        }
+    }
+
     for (i = 0; i < npds; i++) {
         /* 计算新的 events */
         fd = pds[i].fd;
@@ -222,7 +297,7 @@ static int _st_epoll_pollset_add(struct pollfd *pds, int npds) {
             _ST_EPOLL_EXCEP_CNT(fd)++;
 
         events = _ST_EPOLL_EVENTS(fd);
-        if (events != old_events) {
+        if (events != old_events && !_ST_EPOLL_NETFD(fd)) {
             /* 需要更新事件 */
             op = old_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
             ev.events = events;
@@ -242,7 +317,7 @@ static int _st_epoll_pollset_add(struct pollfd *pds, int npds) {
         /* 没有全部处理成功 */
         int err = errno;
         /* 回滚之前的操作 */
-        _st_epoll_pollset_del(pds, i + 1);
+        _st_epoll_pds_del(pds, i + 1);
         errno = err;
         return -1;
     }
@@ -250,25 +325,244 @@ static int _st_epoll_pollset_add(struct pollfd *pds, int npds) {
     return 0;
 }
 
-/* dispatch 只在没有可执行线程时执行，当其返回以后，应该会有线程重新处于可运行状态 */
-static void _st_epoll_dispatch(void)
+/* 添加 pollq，并把它挂到每个描述符的等待链表上 */
+static int _st_epoll_pollset_add(_st_pollq_t *pq)
+{
+    _st_pollwait_t *w, **head;
+    int i, n;
+
+    if ((n = _st_epoll_pds_add(pq->pds, pq->npds)) != 0)
+        return n;
+
+    for (i = 0; i < pq->npds; i++) {
+        w = &pq->waits[i];
+        head = &_st_epoll_data->fd_data[pq->pds[i].fd].waiters;
+        w->pq = pq;
+        if ((w->next = *head) != NULL)
+            w->next->pprev = &w->next;
+        w->pprev = head;
+        *head = w;
+    }
+
+    return 0;
+}
+
+static void _st_epoll_pollset_del(_st_pollq_t *pq)
+{
+    _st_pollwait_t *w;
+    int i;
+
+    for (i = 0; i < pq->npds; i++) {
+        w = &pq->waits[i];
+        if ((*w->pprev = w->next) != NULL)
+            w->next->pprev = w->pprev;
+    }
+
+    _st_epoll_pds_del(pq->pds, pq->npds);
+}
+
+/*
+ * 以微秒精度等待 timeout(ST_UTIME_NO_TIMEOUT 表示一直等待)。epoll_wait 只有毫秒精度，整毫秒的超时
+ * 直接使用它，其余的优先使用 epoll_pwait2，它不可用(EINTR 以外的任何错误)时用 timerfd 定时，epoll_wait 一直等待
+ */
+static int _st_epoll_wait(st_utime_t timeout)
+{
+    struct timespec ts;
+    struct itimerspec its;
+    struct epoll_event ev;
+    int nfd;
+
+    if (timeout == ST_UTIME_NO_TIMEOUT)
+        return epoll_wait(_st_epoll_data->epfd, _st_epoll_data->evtlist, _st_epoll_data->evtlist_size, -1);
+
+    if (timeout % 1000 == 0)
+        return epoll_wait(_st_epoll_data->epfd, _st_epoll_data->evtlist, _st_epoll_data->evtlist_size, (int) (timeout / 1000));
+
+    if (_st_epoll_pwait2_ok) {
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        nfd = syscall(__NR_epoll_pwait2, _st_epoll_data->epfd, _st_epoll_data->evtlist,
+                      _st_epoll_data->evtlist_size, &ts, NULL, 0);
+        if (nfd >= 0 || errno == EINTR)
+            return nfd;
+        /* 除 ENOSYS 外，seccomp 等策略也可能让它返回 EPERM 之类的错误，都不再使用它 */
+        _st_epoll_pwait2_ok = 0;
+    }
+
+    if (_st_epoll_data->timerfd < 0) {
+        /* 边沿触发，到期后不需要 read，重新 settime 时计数也会清零 */
+        _st_epoll_data->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = _st_epoll_data->timerfd;
+        if (_st_epoll_data->timerfd >= 0 &&
+            epoll_ctl(_st_epoll_data->epfd, EPOLL_CTL_ADD, _st_epoll_data->timerfd, &ev) < 0) {
+            close(_st_epoll_data->timerfd);
+            _st_epoll_data->timerfd = -1;
+        }
+    }
+
+    if (_st_epoll_data->timerfd >= 0) {
+        /* 一次性定时器，提前被 IO 唤醒时不撤销，最多带来一次多余的唤醒 */
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = timeout / 1000000;
+        its.it_value.tv_nsec = (timeout % 1000000) * 1000;
+        if (timerfd_settime(_st_epoll_data->timerfd, 0, &its, NULL) == 0)
+            return epoll_wait(_st_epoll_data->epfd, _st_epoll_data->evtlist, _st_epoll_data->evtlist_size, -1);
+    }
+
+    /* 都不可用，向上取整到毫秒，宁可晚醒也不要提前醒来空转 */
+    return epoll_wait(_st_epoll_data->epfd, _st_epoll_data->evtlist, _st_epoll_data->evtlist_size,
+                      (int) ((timeout + 999) / 1000));
+}
+
+/*
+ * 边沿触发模式: netfd 打开时以 EPOLLET 注册读写事件，直到关闭都不再修改。等待它的线程挂在 netfd 的
+ * wait_q 上，事件到达时直接唤醒，不需要 st_poll 那样每次等待都 epoll_ctl 添加、删除
+ */
+static int _st_epoll_netfd_add(_st_netfd_t *fd)
+{
+    struct epoll_event ev;
+    int osfd = fd->osfd;
+
+    if (osfd >= _st_epoll_data->fd_data_size && _st_epoll_fd_data_expand(osfd) < 0)
+        return -1;
+    if (_ST_EPOLL_NETFD(osfd) || _ST_EPOLL_EVENTS(osfd)) {
+        /* 已经在被 st_poll 等待 */
+        errno = EBUSY;
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = osfd;
+    if (epoll_ctl(_st_epoll_data->epfd, EPOLL_CTL_ADD, osfd, &ev) < 0)
+        return -1;
+
+    _st_epoll_data->fd_data[osfd].netfd = fd;
+    _st_epoll_data->evtlist_cnt++;
+    if (_st_epoll_data->evtlist_cnt > _st_epoll_data->evtlist_size)
+        _st_epoll_evtlist_expand();
+
+    return 0;
+}
+
+static void _st_epoll_netfd_del(_st_netfd_t *fd)
+{
+    struct epoll_event ev;
+    int osfd = fd->osfd;
+
+    epoll_ctl(_st_epoll_data->epfd, EPOLL_CTL_DEL, osfd, &ev);
+    _st_epoll_data->fd_data[osfd].netfd = NULL;
+    _st_epoll_data->evtlist_cnt--;
+}
+
+/* netfd 上有事件到达，更新 ready 并唤醒等待相应事件的线程。出错或者挂断时读写都不会再阻塞 */
+static void _st_epoll_netfd_ready(_st_netfd_t *fd, int events)
 {
-    st_utime_t min_timeout;
-    _st_clist_t *q;
+    _st_clist_t *q, *next;
     _st_pollq_t *pq;
+    int ready = 0;
+    short revents;
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        ready |= POLLIN;
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        ready |= POLLOUT;
+    if (events & EPOLLPRI)
+        ready |= POLLPRI;
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        ready |= _ST_READY_HUP;
+    fd->ready |= ready;
+
+    for (q = fd->wait_q.next; q != &fd->wait_q; q = next) {
+        next = q->next;
+        pq = _ST_POLLQUEUE_PTR(q);
+        revents = pq->pds->events & ready;
+        if (events & EPOLLERR)
+            revents |= POLLERR;
+        if (events & EPOLLHUP)
+            revents |= POLLHUP;
+        if (!revents)
+            continue;
+
+        pq->pds->revents = revents;
+        ST_REMOVE_LINK(&pq->links);
+        pq->on_ioq = 0;
+        if (pq->thread->flags & _ST_FL_ON_SLEEPQ)
+            _ST_DEL_SLEEPQ(pq->thread);
+        pq->thread->state = _ST_ST_RUNNABLE;
+        _ST_ADD_RUNQ(pq->thread);
+    }
+}
+
+/*
+ * 阻塞之前先以 0 超时轮询最多 spin_window 微秒，省掉一次睡眠与唤醒的开销。自旋等到了事件就把窗口加倍，
+ * 没等到就减半，但不低于上限的 1/16，以便负载变化后还能重新变大。返回 epoll_wait 的结果，
+ * 没有等到事件时从 timeout 中扣除自旋的时间
+ */
+static int _st_epoll_busy_poll(st_utime_t *timeout)
+{
+    st_utime_t window, start, elapsed, floor;
+    int nfd;
+
+    floor = (_st_busy_poll_usecs / 16) ? (_st_busy_poll_usecs / 16) : 1;
+    if (_st_epoll_data->spin_window < floor || _st_epoll_data->spin_window > _st_busy_poll_usecs)
+        _st_epoll_data->spin_window = _st_busy_poll_usecs;
+    window = _st_epoll_data->spin_window;
+    if (window > *timeout)
+        window = *timeout;
+
+    start = st_utime();
+    do {
+        nfd = epoll_wait(_st_epoll_data->epfd, _st_epoll_data->evtlist, _st_epoll_data->evtlist_size, 0);
+        elapsed = st_utime() - start;
+    } while (nfd == 0 && elapsed < window);
+
+    if (nfd > 0) {
+        _st_epoll_data->spin_window *= 2;
+        if (_st_epoll_data->spin_window > _st_busy_poll_usecs)
+            _st_epoll_data->spin_window = _st_busy_poll_usecs;
+        return nfd;
+    }
+
+    _st_epoll_data->spin_window /= 2;
+    if (_st_epoll_data->spin_window < floor)
+        _st_epoll_data->spin_window = floor;
+    if (*timeout != ST_UTIME_NO_TIMEOUT)
+        *timeout = (elapsed >= *timeout) ? 0 : (*timeout - elapsed);
+
+    return nfd;
+}
+
+/*
+ * dispatch 通常只在没有可执行线程时执行(block 为 1)，当其返回以后，应该会有线程重新处于可运行状态
+ * 开启强制轮询时，调度器在有可执行线程的情况下也会周期性地以 block 为 0 调用，只收集已经就绪的事件
+ */
+static void _st_epoll_dispatch(int block)
+{
+    st_utime_t timeout, now;
+    _st_clist_t *q, woken;
+    _st_pollq_t *pq;
+    _st_pollwait_t *w;
     struct pollfd *pds, *epds;
     struct epoll_event ev;
-    int timeout, nfd, i, osfd, notify;
+    int nfd, i, osfd, fd, notify;
     int events, op;
     short revents;
 
-    /* 根据休眠队列计算等待时间 */
-    if (_ST_SLEEPQ == NULL) {
-        timeout = -1;
-    } else {
-        // 设置超时时间，如果已经有超时的 sleep routine，设置为 0, 否则设置为下一个带 wake 的 routine 时间
-        min_timeout = (_ST_SLEEPQ->due <= _ST_LAST_CLOCK) ? 0 : (_ST_SLEEPQ->due - _ST_LAST_CLOCK);
-        timeout = (int) (min_timeout / 1000);
+    /* 根据休眠队列与时间轮计算等待时间 */
+    timeout = block ? _st_sleep_next_due() : 0;
+    if (timeout != ST_UTIME_NO_TIMEOUT && timeout != 0) {
+        /*
+         * 如果已经有超时的线程，不等待，否则等待到下一个超时时间。_ST_LAST_CLOCK 在线程运行期间
+         * 不会更新，这里重新取一次时间，避免少等了线程运行的那段时间后醒来空转
+         */
+        now = st_utime();
+        timeout = (timeout <= now) ? 0 : (timeout - now);
+    }
+
+    if (((_st_work_stealing && _st_steal_nrings > 1) || _ST_VP_LENT()) && timeout > ST_STEAL_POLL_MSECS * 1000) {
+        /* 其他 vp 可能产生新的可窃取线程，或者正在结束从这里窃取的线程，不能无限期地阻塞 */
+        timeout = ST_STEAL_POLL_MSECS * 1000;
     }
 
     if (_st_epoll_data->pid != getpid()) {
@@ -281,22 +575,85 @@ static void _st_epoll_dispatch(void)
         fcntl(_st_epoll_data->epfd, F_SETFD, FD_CLOEXEC);
         _st_epoll_data->pid = getpid();
 
-        /* 把 IOQ 中的所有文件描述符添加到事件系统中 */
-        memset(_st_epoll_data->fd_data, 0, _st_epoll_data->fd_data_size * sizeof(_epoll_fd_data_t));
+        _st_epoll_data->busy_poll_set = 0;
+
+        /* timerfd 与父进程共享同一个定时器，关闭后按需重新创建 */
+        if (_st_epoll_data->timerfd >= 0) {
+            close(_st_epoll_data->timerfd);
+            _st_epoll_data->timerfd = -1;
+        }
+
+        /* 重新注册边沿触发的 netfd，再把 IOQ 中的所有文件描述符添加到事件系统中 */
+        for (i = 0; i < _st_epoll_data->fd_data_size; i++) {
+            _st_netfd_t *netfd = _ST_EPOLL_NETFD(i);
+            memset(&_st_epoll_data->fd_data[i], 0, sizeof(_epoll_fd_data_t));
+            _st_epoll_data->fd_data[i].netfd = netfd;
+        }
         _st_epoll_data->evtlist_cnt = 0;
-        for (q = _ST_IOQ.next; q != &_ST_IOQ; q = q->next) {
+        for (i = 0; i < _st_epoll_data->fd_data_size; i++) {
+            _st_netfd_t *netfd = _st_epoll_data->fd_data[i].netfd;
+            if (netfd) {
+                /* 重新注册时如果已经就绪会马上报告一次，清除 ready 让下面的 pollset_add 不会直接返回 */
+                _st_epoll_data->fd_data[i].netfd = NULL;
+                netfd->ready = 0;
+                if (_st_epoll_netfd_add(netfd) < 0)
+                    netfd->et = 0;
+            }
+        }
+        for (q = _ST_IOQ.next; q != &_ST_IOQ; ) {
             pq = _ST_POLLQUEUE_PTR(q);
-            _st_epoll_pollset_add(pq->pds, pq->npds);
+            q = q->next;
+            if ((nfd = _st_epoll_pollset_add(pq)) == 0)
+                continue;
+            /*
+             * 已经就绪(revents 已经由 poll 填好)或者注册失败，等待节点都没有挂到链表上，不能留在 IOQ 中
+             * 之后再被 pollset_del，直接唤醒线程。注册失败时每个描述符都报告 POLLERR，让线程重试 IO
+             * 得到真正的错误
+             */
+            if (nfd < 0) {
+                for (i = 0; i < pq->npds; i++)
+                    pq->pds[i].revents = POLLERR;
+            }
+            ST_REMOVE_LINK(&pq->links);
+            pq->on_ioq = 0;
+            if (pq->thread->flags & _ST_FL_ON_SLEEPQ)
+                _ST_DEL_SLEEPQ(pq->thread);
+            pq->thread->state = _ST_ST_RUNNABLE;
+            _ST_ADD_RUNQ(pq->thread);
         }
     }
 
+    if ((_st_busy_poll_flags & ST_BUSY_POLL_EPOLL) && !_st_epoll_data->busy_poll_set) {
+        /* 让内核在 epoll_wait 中直接轮询网卡队列，内核不支持或者没有权限时忽略 */
+        struct epoll_params params;
+
+        memset(&params, 0, sizeof(params));
+        params.busy_poll_usecs = (uint32_t) _st_busy_poll_usecs;
+        params.busy_poll_budget = 8;
+        params.prefer_busy_poll = 1;
+        (void) ioctl(_st_epoll_data->epfd, EPIOCSPARAMS, &params);
+        _st_epoll_data->busy_poll_set = 1;
+    }
+
     /* 等待 IO 事件发生 */
-    nfd = epoll_wait(_st_epoll_data->epfd, _st_epoll_data->evtlist, _st_epoll_data->evtlist_size, timeout);
+    nfd = 0;
+    if (block && _st_busy_poll_usecs && timeout != 0)
+        nfd = _st_epoll_busy_poll(&timeout);
+    if (nfd == 0)
+        nfd = _st_epoll_wait(timeout);
 
     if (nfd > 0) {
         /* 如果触发了 IO 事件 */
         for (i = 0; i < nfd; i++) {
             osfd = _st_epoll_data->evtlist[i].data.fd;
+            if (osfd == _st_epoll_data->timerfd) {
+                /* 只是超时唤醒 */
+                continue;
+            }
+            if (_ST_EPOLL_NETFD(osfd)) {
+                /* 边沿触发的 netfd，直接唤醒等待它的线程 */
+                _st_epoll_netfd_ready(_ST_EPOLL_NETFD(osfd), _st_epoll_data->evtlist[i].events);
+            }
             _ST_EPOLL_REVENTS(osfd) = _st_epoll_data->evtlist[i].events;
             if (_ST_EPOLL_REVENTS(osfd) & (EPOLLERR | EPOLLHUP)) {
                 /* 发生了错误 */
@@ -304,50 +661,67 @@ static void _st_epoll_dispatch(void)
             }
         }
 
-        /* 遍历 IOQ */
-        for (q = _ST_IOQ.next; q != &_ST_IOQ; q = q->next) {
-            pq = _ST_POLLQUEUE_PTR(q);
-            notify = 0;
-            epds = pq->pds + pq->npds;
-
-            for (pds = pq->pds; pds < epds; pds++) {
-                if (_ST_EPOLL_REVENTS(pds->fd) == 0) {
-                    pds->revents = 0;
+        /* 只检查等待就绪描述符的 pollq，唤醒的先放到 woken 中，全部检查完再删除，以免改动正在遍历的等待链表 */
+        ST_INIT_CLIST(&woken);
+        for (i = 0; i < nfd; i++) {
+            osfd = _st_epoll_data->evtlist[i].data.fd;
+            if (osfd == _st_epoll_data->timerfd)
+                continue;
+            for (w = _st_epoll_data->fd_data[osfd].waiters; w; w = w->next) {
+                pq = w->pq;
+                /* pollq 分散在各个线程的栈上，预取下一个 */
+                if (w->next)
+                    _ST_PREFETCH(w->next->pq);
+                if (!pq->on_ioq)
                     continue;
+                notify = 0;
+                epds = pq->pds + pq->npds;
+
+                for (pds = pq->pds; pds < epds; pds++) {
+                    if (_ST_EPOLL_REVENTS(pds->fd) == 0) {
+                        pds->revents = 0;
+                        continue;
+                    }
+                    /* 计算触发事件的 events */
+                    fd = pds->fd;
+                    events = pds->events;
+                    revents = 0;
+                    if ((events & POLLIN) && (_ST_EPOLL_REVENTS(fd) & EPOLLIN))
+                        revents |= POLLIN;
+                    if ((events & POLLOUT) && (_ST_EPOLL_REVENTS(fd) & EPOLLOUT))
+                        revents |= POLLOUT;
+                    if ((events & POLLPRI) && (_ST_EPOLL_REVENTS(fd) & EPOLLPRI))
+                        revents |= POLLPRI;
+                    if (_ST_EPOLL_REVENTS(fd) & EPOLLERR)
+                        revents |= POLLERR;
+                    if (_ST_EPOLL_REVENTS(fd) & EPOLLHUP)
+                        revents |= POLLHUP;
+
+                    pds->revents = revents;
+                    if (revents) {
+                        notify = 1;
+                    }
                 }
-                /* 计算触发事件的 events */
-                osfd = pds->fd;
-                events = pds->events;
-                revents = 0;
-                if ((events & POLLIN) && (_ST_EPOLL_REVENTS(osfd) & EPOLLIN))
-                    revents |= POLLIN;
-                if ((events & POLLOUT) && (_ST_EPOLL_REVENTS(osfd) & EPOLLOUT))
-                    revents |= POLLOUT;
-                if ((events & POLLPRI) && (_ST_EPOLL_REVENTS(osfd) & EPOLLPRI))
-                    revents |= POLLPRI;
-                if (_ST_EPOLL_REVENTS(osfd) & EPOLLERR)
-                    revents |= POLLERR;
-                if (_ST_EPOLL_REVENTS(osfd) & EPOLLHUP)
-                    revents |= POLLHUP;
-
-                pds->revents = revents;
-                if (revents) {
-                    notify = 1;
+                if (notify) {
+                    /* 有 IO 事件发生, 从 IOQ 移除 */
+                    ST_REMOVE_LINK(&pq->links);
+                    pq->on_ioq = 0;
+                    ST_APPEND_LINK(&pq->links, &woken);
+
+                    /* 如果线程在休眠队列，将其唤醒 */
+                    if (pq->thread->flags & _ST_FL_ON_SLEEPQ)
+                        _ST_DEL_SLEEPQ(pq->thread);
+                    pq->thread->state = _ST_ST_RUNNABLE;
+                    _ST_ADD_RUNQ(pq->thread);
                 }
             }
-            if (notify) {
-                /* 有 IO 事件发生, 从 IOQ 移除 */
-                ST_REMOVE_LINK(&pq->links);
-                pq->on_ioq = 0;
-                /* 这个调用只会删除没有触发 IO 事件的描述符 */
-                _st_epoll_pollset_del(pq->pds, pq->npds);
-
-                /* 如果线程在休眠队列，将其唤醒 */
-                if (pq->thread->flags & _ST_FL_ON_SLEEPQ)
-                    _ST_DEL_SLEEPQ(pq->thread);
-                pq->thread->state = _ST_ST_RUNNABLE;
-                _ST_ADD_RUNQ(pq->thread);
-            }
+        }
+
+        while ((q = woken.next) != &woken) {
+            pq = _ST_POLLQUEUE_PTR(q);
+            ST_REMOVE_LINK(q);
+            /* 这个调用只会删除没有触发 IO 事件的描述符 */
+            _st_epoll_pollset_del(pq);
         }
 
         for (i = 0; i < nfd; i++) {
@@ -356,7 +730,11 @@ static void _st_epoll_dispatch(void)
              * 之后我们是要将其从事件系统中删除的
              */
             osfd = _st_epoll_data->evtlist[i].data.fd;
+            if (osfd == _st_epoll_data->timerfd)
+                continue;
             _ST_EPOLL_REVENTS(osfd) = 0;
+            if (_ST_EPOLL_NETFD(osfd))
+                continue;
             events = _ST_EPOLL_EVENTS(osfd);
             op = events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
             ev.events = events;
@@ -368,6 +746,20 @@ static void _st_epoll_dispatch(void)
     }
 }
 
+/* 设置阻塞前的自旋轮询 */
+int st_set_busy_poll(st_utime_t usecs, int flags)
+{
+    if (usecs == ST_UTIME_NO_TIMEOUT || (flags & ~(ST_BUSY_POLL_SOCKET | ST_BUSY_POLL_EPOLL))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _st_busy_poll_usecs = usecs;
+    _st_busy_poll_flags = usecs ? flags : 0;
+
+    return 0;
+}
+
 /* 类似于告知文件系统，我要添加对 osfd 的处理，请保证空间足够 */
 static int _st_epoll_fd_new(int osfd)
 {
@@ -403,8 +795,55 @@ static _st_eventsys_t _st_epoll_eventsys = {
     _st_epoll_pollset_del,
     _st_epoll_fd_new,
     _st_epoll_fd_close,
-    _st_epoll_fd_getlimit
+    _st_epoll_fd_getlimit,
+    _st_epoll_netfd_add,
+    _st_epoll_netfd_del,
+    NULL
 };
 
-/* 在 state-thread 中可以通过条件编译指定不同的 backend，我们直接指定为 epoll */
-_st_eventsys_t *_st_eventsys = &_st_epoll_eventsys;
\ No newline at end of file
+/* 默认使用 epoll，可以在 st_init 之前通过 st_set_eventsys 选择 io_uring */
+_st_eventsys_t *_st_eventsys = &_st_epoll_eventsys;
+static int _st_eventsys_id = ST_EVENTSYS_EPOLL;
+
+int st_set_eventsys(int eventsys)
+{
+    if (_st_active_count) {
+        /* 已经初始化过了 */
+        errno = EBUSY;
+        return -1;
+    }
+
+    switch (eventsys) {
+    case ST_EVENTSYS_DEFAULT:
+    case ST_EVENTSYS_EPOLL:
+        _st_eventsys = &_st_epoll_eventsys;
+        eventsys = ST_EVENTSYS_EPOLL;
+        break;
+    case ST_EVENTSYS_IO_URING:
+#ifdef _ST_HAVE_IO_URING
+        if (_st_uring_probe() < 0)
+            return -1;
+        _st_eventsys = &_st_uring_eventsys;
+        break;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    _st_eventsys_id = eventsys;
+    return 0;
+}
+
+int st_get_eventsys(void)
+{
+    return _st_eventsys_id;
+}
+
+const char *st_get_eventsys_name(void)
+{
+    return _st_eventsys->name;
+}
\ No newline at end of file
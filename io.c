@@ -28,10 +28,14 @@
 
 #define _LOCAL_MAXIOV  16
 
-/* 文件描述也用一个双向链表管理 */
-static _st_netfd_t *_st_netfd_freelist = NULL;
+/* 文件描述也用一个双向链表管理，每个 vp 一个 */
+static _ST_TLS _st_netfd_t *_st_netfd_freelist = NULL;
 /* 系统文件描述符上限 */
 static int _st_osfd_limit = -1;
+/* 之后打开的 socket 是否以边沿触发方式持久注册到事件系统 */
+static int _st_edge_triggered = 0;
+/* 就绪缓存的统计，见 st_io_stats */
+static _ST_TLS st_io_stats_t _st_io_stats;
 
 int _st_io_init() {
     struct sigaction sigact;
@@ -73,6 +77,12 @@ void st_netfd_free(_st_netfd_t *fd) {
         return;
 
     fd->inuse = 0;
+    if (fd->et) {
+        /* 在其他 vp 上释放时无法修改注册所在 vp 的数据，由那个 vp 的事件系统发现 et 为 0 后清理 */
+        if (fd->vp == &_st_this_vp)
+            (*_st_eventsys->netfd_del)(fd);
+        fd->et = 0;
+    }
     if (fd->private_data && fd->destructor)
         (*(fd->destructor))(fd->private_data);
     fd->private_data = NULL;
@@ -104,32 +114,75 @@ static _st_netfd_t *_st_netfd_new(int osfd, int nonblock, int is_socket) {
     fd->osfd = osfd;
     fd->inuse = 1;
     fd->next = NULL;
+    fd->et = 0;
+    fd->ready = 0;
+    ST_INIT_CLIST(&fd->wait_q);
     
     if (nonblock) {
         /* 设置非阻塞，注意，IO 复用模型一定要配合非阻塞 IO！没有任何道理使用阻塞 IO */
-        if (is_socket && ioctl(osfd, FIONBIO, &flags) != -1)
-            return fd;
-        if ((flags = fcntl(osfd, F_GETFL, 0)) < 0 ||
-            fcntl(osfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        if (!(is_socket && ioctl(osfd, FIONBIO, &flags) != -1) &&
+            ((flags = fcntl(osfd, F_GETFL, 0)) < 0 ||
+             fcntl(osfd, F_SETFL, flags | O_NONBLOCK) < 0)) {
             st_netfd_free(fd);
             return NULL;
         }
     }
 
+    /* 边沿触发需要非阻塞 IO，注册失败的话退回到每次等待时注册 */
+    if (_st_edge_triggered && nonblock && is_socket)
+        (void) _st_netfd_persist(fd);
+
     return fd;
 }
 
+/* 以边沿触发方式把 netfd 持久注册到当前 vp 的事件系统 */
+int _st_netfd_persist(_st_netfd_t *fd) {
+    int type = 0;
+    socklen_t len = sizeof(type);
+
+    if ((*_st_eventsys->netfd_add)(fd) < 0)
+        return -1;
+
+    fd->et = 1;
+    fd->vp = &_st_this_vp;
+    /* 还不知道是否就绪，先当作就绪，第一次读写总是会尝试系统调用 */
+    fd->ready = POLLIN | POLLOUT | POLLPRI;
+    fd->stream = getsockopt(fd->osfd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+    return 0;
+}
+
+int st_edge_triggered(int on) {
+    int old = _st_edge_triggered;
+
+    _st_edge_triggered = on;
+    return old;
+}
+
 _st_netfd_t *st_netfd_open(int osfd) {
     return _st_netfd_new(osfd, 1, 0);
 }
 
 
 _st_netfd_t *st_netfd_open_socket(int osfd) {
+    int usecs;
+
+    if (_st_busy_poll_flags & ST_BUSY_POLL_SOCKET) {
+        /* 在这个 socket 上阻塞读时内核先轮询网卡队列，超过 net.core.busy_read 需要 CAP_NET_ADMIN，失败时忽略 */
+        usecs = (int) _st_busy_poll_usecs;
+        (void) setsockopt(osfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+    }
+
     return _st_netfd_new(osfd, 1, 1);
 }
 
 /* 关闭文件描述符 */
 int st_netfd_close(_st_netfd_t *fd) {
+    if (fd->et && !ST_CLIST_IS_EMPTY(&fd->wait_q)) {
+        /* 还有线程在等待这个描述符 */
+        errno = EBUSY;
+        return -1;
+    }
+
     /* 从事件系统删除 */
     if ((*_st_eventsys->fd_close)(fd->osfd) < 0)
         return -1;
@@ -160,6 +213,83 @@ void *st_netfd_getspecific(_st_netfd_t *fd) {
     return (fd->private_data);
 }
 
+/*
+ * 等待边沿触发的 netfd 就绪。ready 中还有相应事件的话直接返回，否则挂到 netfd 的 wait_q 上，
+ * 由事件系统在新的事件到达时唤醒，不需要修改 epoll 的注册
+ */
+static int _st_netfd_et_poll(_st_netfd_t *fd, struct pollfd *pd, st_utime_t timeout) {
+    _st_pollq_t pq;
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+
+    if (me->flags & _ST_FL_INTERRUPT) {
+        me->flags &= ~_ST_FL_INTERRUPT;
+        errno = EINTR;
+        return -1;
+    }
+
+    if (fd->ready & pd->events) {
+        /* ready 只表示可能就绪，确认一次，没有就绪时之后的数据到达一定会有新的事件 */
+        int n = poll(pd, 1, 0);
+        if (n != 0)
+            return n;
+        fd->ready &= ~pd->events;
+    }
+
+    pq.pds = pd;
+    pq.npds = 1;
+    pq.thread = me;
+    pq.on_ioq = 1;
+    pq.waits = NULL;
+    ST_APPEND_LINK(&pq.links, &fd->wait_q);
+
+    if (timeout != ST_UTIME_NO_TIMEOUT)
+        _ST_ADD_IO_TIMEOUT(me, timeout);
+    me->state = _ST_ST_IO_WAIT;
+
+    _ST_SWITCH_CONTEXT(me);
+
+    if (pq.on_ioq) {
+        /* 超时或者被打断 */
+        ST_REMOVE_LINK(&pq.links);
+        if (me->flags & _ST_FL_INTERRUPT) {
+            me->flags &= ~_ST_FL_INTERRUPT;
+            errno = EINTR;
+            return -1;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * IO 调用没有完成(返回 EAGAIN、部分读写或者 connect 返回 EINPROGRESS)以后等待描述符就绪。边沿触发的
+ * 描述符先清除 ready 中相应的事件，之后只有新的事件到达才会再次设置。again 表示这次确实看到了 EAGAIN，
+ * 只有这种情况计入统计
+ */
+static int _st_netfd_wait(_st_netfd_t *fd, int how, int again, st_utime_t timeout) {
+    if (again)
+        _st_io_stats.eagain++;
+    fd->ready &= ~how;
+    return st_netfd_poll(fd, how, timeout);
+}
+
+/*
+ * 就绪缓存: 边沿触发的描述符的 ready 中没有 how 时，说明上一次系统调用已经返回了 EAGAIN(或者读空了缓冲区)，
+ * 之后还没有新的事件，这时再调用一定会返回 EAGAIN，直接等待
+ */
+static int _st_netfd_ready_wait(_st_netfd_t *fd, int how, st_utime_t timeout) {
+    if (!fd->et || (fd->ready & how) || fd->vp != &_st_this_vp)
+        return 0;
+    _st_io_stats.eagain_avoided++;
+    return st_netfd_poll(fd, how, timeout);
+}
+
+int st_io_stats(st_io_stats_t *stats) {
+    *stats = _st_io_stats;
+    return 0;
+}
+
 /*
  * 等待单个文件描述符上的 IO 事件就绪
  */
@@ -171,7 +301,12 @@ int st_netfd_poll(_st_netfd_t *fd, int how, st_utime_t timeout) {
     pd.events = (short) how;
     pd.revents = 0;
     
-    if ((n = st_poll(&pd, 1, timeout)) < 0)
+    /* 共享栈线程的等待节点不能放在栈上，由 st_poll 放到堆上 */
+    if (fd->et && fd->vp == &_st_this_vp && !(_ST_CURRENT_THREAD()->flags & _ST_FL_SHARED_STACK))
+        n = _st_netfd_et_poll(fd, &pd, timeout);
+    else
+        n = st_poll(&pd, 1, timeout);
+    if (n < 0)
         return -1;
     if (n == 0) {
         /* 超时 */
@@ -193,11 +328,21 @@ int st_netfd_poll(_st_netfd_t *fd, int how, st_utime_t timeout) {
  * 我们这里省去了这部分的代码
  */
 _st_netfd_t *st_accept(_st_netfd_t *fd, struct sockaddr *addr, int *addrlen, st_utime_t timeout) {
-    int osfd, err;
+    int osfd = -1, err;
     _st_netfd_t *newfd;
     
+    if (_st_eventsys->io) {
+        /* 事件系统直接完成 accept */
+        osfd = (int) (*_st_eventsys->io)(_ST_IO_ACCEPT, fd->osfd, addr, 0, addrlen, timeout);
+        if (osfd < 0 && errno != EAGAIN)
+            return NULL;
+    }
+
+    if (osfd < 0 && _st_netfd_ready_wait(fd, POLLIN, timeout) < 0)
+        return NULL;
+
     /* 先直接调用底层 accept 函数 */
-    while ((osfd = accept(fd->osfd, addr, (socklen_t *)addrlen)) < 0) {
+    while (osfd < 0 && (osfd = accept(fd->osfd, addr, (socklen_t *)addrlen)) < 0) {
         if (errno == EINTR)
             /* 被系统信号中断，重试即可 */
             continue;
@@ -205,7 +350,7 @@ _st_netfd_t *st_accept(_st_netfd_t *fd, struct sockaddr *addr, int *addrlen, st_
             /* 返回了非阻塞以外的错误，返回空指针 */
             return NULL;
         /* 代表读事件为就绪，等待其就绪 */
-        if (st_netfd_poll(fd, POLLIN, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLIN, 1, timeout) < 0)
             return NULL;
     }
     
@@ -225,6 +370,14 @@ _st_netfd_t *st_accept(_st_netfd_t *fd, struct sockaddr *addr, int *addrlen, st_
 int st_connect(_st_netfd_t *fd, const struct sockaddr *addr, int addrlen, st_utime_t timeout) {
     int n, err = 0;
     
+    if (_st_eventsys->io) {
+        /* 事件系统直接完成 connect */
+        if ((*_st_eventsys->io)(_ST_IO_CONNECT, fd->osfd, (void *) addr, addrlen, NULL, timeout) == 0)
+            return 0;
+        if (errno != EAGAIN)
+            return -1;
+    }
+
     /* 直接调用 connect 系统调用 */
     while (connect(fd->osfd, addr, addrlen) < 0) {
         if (errno != EINTR) {
@@ -236,7 +389,7 @@ int st_connect(_st_netfd_t *fd, const struct sockaddr *addr, int addrlen, st_uti
             if (errno != EINPROGRESS && (errno != EADDRINUSE || err == 0))
                 return -1;
             /* 等待描述符可写，这个应该在建立连接后会立马触发(但是不代表一定成功 connect()) */
-            if (st_netfd_poll(fd, POLLOUT, timeout) < 0)
+            if (_st_netfd_wait(fd, POLLOUT, 0, timeout) < 0)
                 return -1;
             /* 查看 socket opt，确定是否成功连接 */
             n = sizeof(int);
@@ -257,15 +410,28 @@ int st_connect(_st_netfd_t *fd, const struct sockaddr *addr, int addrlen, st_uti
 ssize_t st_read(_st_netfd_t *fd, void *buf, size_t nbyte, st_utime_t timeout) {
     ssize_t n;
     
+    if (_st_eventsys->io) {
+        /* 事件系统直接完成读操作 */
+        if ((n = (*_st_eventsys->io)(_ST_IO_READ, fd->osfd, buf, nbyte, NULL, timeout)) >= 0 || errno != EAGAIN)
+            return n;
+    }
+
+    if (_st_netfd_ready_wait(fd, POLLIN, timeout) < 0)
+        return -1;
+
     while ((n = read(fd->osfd, buf, nbyte)) < 0) {
         if (errno == EINTR)
             continue;
         if (!_IO_NOT_READY_ERROR)
             return -1;
         /* Wait until the socket becomes readable */
-        if (st_netfd_poll(fd, POLLIN, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLIN, 1, timeout) < 0)
             return -1;
     }
+
+    /* 流式 socket 读到的比请求的少，接收缓冲区已经空了。对端关闭之后不会再有事件，不能清除 */
+    if (n > 0 && (size_t) n < nbyte && fd->stream && !(fd->ready & _ST_READY_HUP))
+        fd->ready &= ~POLLIN;
     
     return n;
 }
@@ -275,7 +441,26 @@ int st_read_resid(_st_netfd_t *fd, void *buf, size_t *resid, st_utime_t timeout)
 {
     struct iovec iov, *riov;
     int riov_size, rv;
+    ssize_t n;
     
+    if (_st_eventsys->io) {
+        /* 事件系统直接完成读操作，读到 EOF 为止 */
+        while (*resid > 0) {
+            n = (*_st_eventsys->io)(_ST_IO_READ, fd->osfd, buf, *resid, NULL, timeout);
+            if (n < 0) {
+                if (errno != EAGAIN)
+                    return -1;
+                break;
+            }
+            if (n == 0)
+                return 0;
+            buf = (char *) buf + n;
+            *resid -= n;
+        }
+        if (*resid == 0)
+            return 0;
+    }
+
     iov.iov_base = buf;
     iov.iov_len = *resid;
     riov = &iov;
@@ -290,13 +475,16 @@ ssize_t st_readv(_st_netfd_t *fd, const struct iovec *iov, int iov_size, st_utim
 {
     ssize_t n;
     
+    if (_st_netfd_ready_wait(fd, POLLIN, timeout) < 0)
+        return -1;
+
     while ((n = readv(fd->osfd, iov, iov_size)) < 0) {
         if (errno == EINTR)
             continue;
         if (!_IO_NOT_READY_ERROR)
             return -1;
         /* Wait until the socket becomes readable */
-        if (st_netfd_poll(fd, POLLIN, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLIN, 1, timeout) < 0)
             return -1;
     }
     
@@ -307,6 +495,9 @@ int st_readv_resid(_st_netfd_t *fd, struct iovec **iov, int *iov_size, st_utime_
 {
     ssize_t n;
     
+    if (_st_netfd_ready_wait(fd, POLLIN, timeout) < 0)
+        return -1;
+
     while (*iov_size > 0) {
         if (*iov_size == 1)
             n = read(fd->osfd, (*iov)->iov_base, (*iov)->iov_len);
@@ -335,7 +526,7 @@ int st_readv_resid(_st_netfd_t *fd, struct iovec **iov, int *iov_size, st_utime_
             (*iov)->iov_len -= n;
         }
         /* Wait until the socket becomes readable */
-        if (st_netfd_poll(fd, POLLIN, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLIN, n < 0, timeout) < 0)
             return -1;
     }
     
@@ -355,7 +546,24 @@ int st_write_resid(_st_netfd_t *fd, const void *buf, size_t *resid, st_utime_t t
 {
     struct iovec iov, *riov;
     int riov_size, rv;
+    ssize_t n;
     
+    if (_st_eventsys->io) {
+        /* 事件系统直接完成写操作，部分写入时继续写剩下的 */
+        while (*resid > 0) {
+            n = (*_st_eventsys->io)(_ST_IO_WRITE, fd->osfd, (void *) buf, *resid, NULL, timeout);
+            if (n < 0) {
+                if (errno != EAGAIN)
+                    return -1;
+                break;
+            }
+            buf = (const char *) buf + n;
+            *resid -= n;
+        }
+        if (*resid == 0)
+            return 0;
+    }
+
     iov.iov_base = (void *) buf;        /* we promise not to modify buf */
     iov.iov_len = *resid;
     riov = &iov;
@@ -436,7 +644,7 @@ ssize_t st_writev(_st_netfd_t *fd, const struct iovec *iov, int iov_size, st_uti
             }
         }
         /* Wait until the socket becomes writable */
-        if (st_netfd_poll(fd, POLLOUT, timeout) < 0) {
+        if (_st_netfd_wait(fd, POLLOUT, n < 0, timeout) < 0) {
             rv = -1;
             break;
         }
@@ -453,6 +661,9 @@ int st_writev_resid(_st_netfd_t *fd, struct iovec **iov, int *iov_size, st_utime
 {
     ssize_t n;
     
+    if (_st_netfd_ready_wait(fd, POLLOUT, timeout) < 0)
+        return -1;
+
     while (*iov_size > 0) {
         if (*iov_size == 1)
             n = write(fd->osfd, (*iov)->iov_base, (*iov)->iov_len);
@@ -479,7 +690,7 @@ int st_writev_resid(_st_netfd_t *fd, struct iovec **iov, int *iov_size, st_utime
             (*iov)->iov_len -= n;
         }
         /* Wait until the socket becomes writable */
-        if (st_netfd_poll(fd, POLLOUT, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLOUT, n < 0, timeout) < 0)
             return -1;
     }
     
@@ -494,13 +705,16 @@ int st_recvfrom(_st_netfd_t *fd, void *buf, int len, struct sockaddr *from, int
 {
     int n;
     
+    if (_st_netfd_ready_wait(fd, POLLIN, timeout) < 0)
+        return -1;
+
     while ((n = recvfrom(fd->osfd, buf, len, 0, from, (socklen_t *)fromlen)) < 0) {
         if (errno == EINTR)
             continue;
         if (!_IO_NOT_READY_ERROR)
             return -1;
         /* Wait until the socket becomes readable */
-        if (st_netfd_poll(fd, POLLIN, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLIN, 1, timeout) < 0)
             return -1;
     }
     
@@ -512,13 +726,16 @@ int st_sendto(_st_netfd_t *fd, const void *msg, int len, const struct sockaddr *
 {
     int n;
     
+    if (_st_netfd_ready_wait(fd, POLLOUT, timeout) < 0)
+        return -1;
+
     while ((n = sendto(fd->osfd, msg, len, 0, to, tolen)) < 0) {
         if (errno == EINTR)
             continue;
         if (!_IO_NOT_READY_ERROR)
             return -1;
         /* Wait until the socket becomes writable */
-        if (st_netfd_poll(fd, POLLOUT, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLOUT, 1, timeout) < 0)
             return -1;
     }
     
@@ -530,13 +747,16 @@ int st_recvmsg(_st_netfd_t *fd, struct msghdr *msg, int flags, st_utime_t timeou
 {
     int n;
     
+    if (_st_netfd_ready_wait(fd, POLLIN, timeout) < 0)
+        return -1;
+
     while ((n = recvmsg(fd->osfd, msg, flags)) < 0) {
         if (errno == EINTR)
             continue;
         if (!_IO_NOT_READY_ERROR)
             return -1;
         /* Wait until the socket becomes readable */
-        if (st_netfd_poll(fd, POLLIN, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLIN, 1, timeout) < 0)
             return -1;
     }
     
@@ -548,13 +768,16 @@ int st_sendmsg(_st_netfd_t *fd, const struct msghdr *msg, int flags, st_utime_t
 {
     int n;
     
+    if (_st_netfd_ready_wait(fd, POLLOUT, timeout) < 0)
+        return -1;
+
     while ((n = sendmsg(fd->osfd, msg, flags)) < 0) {
         if (errno == EINTR)
             continue;
         if (!_IO_NOT_READY_ERROR)
             return -1;
         /* Wait until the socket becomes writable */
-        if (st_netfd_poll(fd, POLLOUT, timeout) < 0)
+        if (_st_netfd_wait(fd, POLLOUT, 1, timeout) < 0)
             return -1;
     }
     
@@ -578,8 +801,9 @@ int st_sendmmsg(st_netfd_t fd, struct st_mmsghdr *msgvec, unsigned int vlen, int
             if (!_IO_NOT_READY_ERROR)
                 break;
             /* Wait until the socket becomes writable */
-            if (st_netfd_poll(fd, POLLOUT, timeout) < 0)
+            if (_st_netfd_wait(fd, POLLOUT, 1, timeout) < 0)
                 break;
+            continue;
         }
 
         left -= n;
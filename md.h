@@ -0,0 +1,105 @@
+#pragma once
+
+/*
+ * 机器相关(machine dependent)的上下文切换实现。
+ * swapcontext 每次切换都会执行一次 rt_sigprocmask 系统调用，并且保存完整的 ucontext_t
+ * (浮点状态，信号掩码等)，在协程切换频繁的场景下开销非常明显。而协程切换本质上就是一次
+ * "函数调用"，按照 ABI 只需要保存 callee-saved 寄存器即可，所以在 x86_64 与 aarch64 上
+ * 我们使用 md.S 中的汇编实现，其他平台或者定义了 ST_SWITCH_UCONTEXT 时仍回退到 ucontext
+ */
+
+#include <ucontext.h>
+
+#if !defined(ST_SWITCH_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+    #define ST_SWITCH_UCONTEXT
+#endif
+
+#ifdef ST_SWITCH_UCONTEXT
+
+/* ucontext 后端，上下文就是完整的 ucontext_t */
+typedef ucontext_t _st_context_t;
+
+#define _ST_MD_NAME "ucontext"
+
+/* 保存当前上下文到 _from，并切换到 _to */
+#define _ST_MD_SWAP(_from, _to) swapcontext((_from), (_to))
+
+/* 在 [_base, _base + _size) 这段栈上构造一个从 _main 开始执行的上下文，_main 返回后进入 _link */
+#define _ST_MD_INIT(_ctx, _base, _size, _main, _link) \
+    ST_BEGIN_MACRO                                  \
+    getcontext(_ctx);                               \
+    (_ctx)->uc_stack.ss_sp = (_base);               \
+    (_ctx)->uc_stack.ss_size = (_size);             \
+    (_ctx)->uc_link = (_link);                      \
+    makecontext((_ctx), (_main), 0);                \
+    ST_END_MACRO
+
+#else
+
+/*
+ * 汇编后端，callee-saved 寄存器都压在线程自己的栈上，上下文只需要记录栈指针
+ * 栈上的布局见 md.S
+ */
+typedef struct _st_context {
+    void *sp; /* 换出时的栈指针 */
+} _st_context_t;
+
+#if defined(__x86_64__)
+    #define _ST_MD_NAME "x86_64"
+#else
+    #define _ST_MD_NAME "aarch64"
+#endif
+
+/* 以下两个函数由 md.S 实现 */
+
+/* 保存 callee-saved 寄存器到当前栈，将栈指针写入 *from_sp，然后切换到 to_sp 上保存的上下文 */
+void _st_md_cxt_swap(void **from_sp, void *to_sp);
+/* 新上下文第一次被切换到时的入口，负责调用真正的 main 函数 */
+void _st_md_cxt_start(void);
+
+/*
+ * 构造一个新上下文的初始栈帧，使得第一次 swap 到它时会 "返回" 到 _st_md_cxt_start，
+ * 并由其调用 main。main 不允许返回(_st_thread_main 与 _st_vp_schedule 都不会返回)
+ */
+static inline void _st_md_cxt_init(_st_context_t *ctx, char *base, size_t size, void (*main)(void)) {
+    /* 栈从高地址向低地址增长，栈顶 16 字节对齐 */
+    void **sp = (void **)((unsigned long)(base + size) & ~0xfUL);
+
+#if defined(__x86_64__)
+    /*
+     * 从低地址到高地址依次为: mxcsr/x87 控制字, r15, r14, r13, r12, rbx, rbp, 返回地址
+     * 返回地址之上再留一个 0 作为伪造的调用者返回地址，ret 之后栈指针 16 字节对齐
+     */
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = (void *)_st_md_cxt_start; /* 返回地址 */
+    *--sp = 0;                        /* rbp */
+    *--sp = 0;                        /* rbx */
+    *--sp = (void *)main;             /* r12，_st_md_cxt_start 通过它得到 main */
+    *--sp = 0;                        /* r13 */
+    *--sp = 0;                        /* r14 */
+    *--sp = 0;                        /* r15 */
+    *--sp = (void *)0x037f00001f80UL; /* 默认的 x87 控制字(高 32 位)与 mxcsr(低 32 位) */
+#else
+    /*
+     * 共 22 个槽位(176 字节): x19-x28, x29(fp), x30(lr), d8-d15
+     * lr 指向 _st_md_cxt_start，x19 保存 main
+     */
+    int i;
+    sp -= 22;
+    for (i = 0; i < 22; i++)
+        sp[i] = 0;
+    sp[0] = (void *)main;              /* x19 */
+    sp[11] = (void *)_st_md_cxt_start; /* x30 */
+#endif
+
+    ctx->sp = sp;
+}
+
+#define _ST_MD_SWAP(_from, _to) _st_md_cxt_swap(&(_from)->sp, (_to)->sp)
+
+/* 汇编后端不需要 link 上下文，新上下文的 main 不会返回 */
+#define _ST_MD_INIT(_ctx, _base, _size, _main, _link) \
+    _st_md_cxt_init((_ctx), (char *)(_base), (_size), (_main))
+
+#endif
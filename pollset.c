@@ -0,0 +1,153 @@
+/*
+ * 持久的描述符集合。st_poll 每次调用都要把所有描述符注册到事件系统，返回时再删除，一个线程循环等待
+ * 几百个描述符时每一轮都是 O(npds) 次 epoll_ctl。st_pollset 相当于线程自己的一个 epoll 实例:
+ * 描述符增量地添加、删除，等待时只返回就绪的描述符
+ *
+ * 集合内部就是一个 epoll 句柄，它本身也是一个可读即表示有描述符就绪的描述符。等待时先以 0 超时收取，
+ * 没有就绪的再等待这个句柄可读。句柄以边沿触发的方式持久注册在所属 vp 的事件系统中(事件系统不支持时
+ * 退回到 st_poll)，所以每一轮等待与集合大小无关，最多只有两次 epoll_wait
+ */
+
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "common.h"
+
+#ifndef ST_POLLSET_BATCH
+    /* 每次 epoll_wait 最多收取的事件数 */
+    #define ST_POLLSET_BATCH 64
+#endif
+
+typedef struct _st_pollset {
+    int epfd;            /* 集合的 epoll 句柄 */
+    _st_netfd_t *nfd;    /* epfd 的 netfd，等待集合时等待它可读 */
+} _st_pollset_t;
+
+_st_pollset_t *st_pollset_new(void)
+{
+    _st_pollset_t *ps;
+    int err;
+
+    ps = (_st_pollset_t *) calloc(1, sizeof(_st_pollset_t));
+    if (!ps)
+        return NULL;
+
+    if ((ps->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        err = errno;
+        free(ps);
+        errno = err;
+        return NULL;
+    }
+    if (!(ps->nfd = st_netfd_open(ps->epfd))) {
+        err = errno;
+        close(ps->epfd);
+        free(ps);
+        errno = err;
+        return NULL;
+    }
+    /* 注册失败的话每次等待时通过 st_poll 注册 */
+    (void) _st_netfd_persist(ps->nfd);
+
+    return ps;
+}
+
+/* 销毁集合，还有线程在等待时返回 EBUSY */
+int st_pollset_free(_st_pollset_t *ps)
+{
+    if (st_netfd_close(ps->nfd) < 0)
+        return -1;
+    free(ps);
+    return 0;
+}
+
+/* 添加描述符，已经在集合中时修改关注的事件 */
+int st_pollset_add(_st_pollset_t *ps, int osfd, int events)
+{
+    struct epoll_event ev;
+
+    if (osfd < 0 || !events || (events & ~(POLLIN | POLLOUT | POLLPRI))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* 在 data 中同时记下描述符与关注的事件，收取时不需要再查表 */
+    ev.events = (uint32_t) events;
+    ev.data.u64 = ((uint64_t) events << 32) | (uint32_t) osfd;
+    if (epoll_ctl(ps->epfd, EPOLL_CTL_ADD, osfd, &ev) == 0)
+        return 0;
+    if (errno != EEXIST)
+        return -1;
+    return epoll_ctl(ps->epfd, EPOLL_CTL_MOD, osfd, &ev);
+}
+
+int st_pollset_del(_st_pollset_t *ps, int osfd)
+{
+    struct epoll_event ev;
+
+    return epoll_ctl(ps->epfd, EPOLL_CTL_DEL, osfd, &ev);
+}
+
+/* 不等待地收取就绪的描述符，最多 npds 个 */
+static int _st_pollset_collect(_st_pollset_t *ps, struct pollfd *pds, int npds)
+{
+    struct epoll_event evs[ST_POLLSET_BATCH];
+    int n, i, cnt = 0;
+    short events;
+
+    while (cnt < npds) {
+        n = npds - cnt < ST_POLLSET_BATCH ? npds - cnt : ST_POLLSET_BATCH;
+        if ((n = epoll_wait(ps->epfd, evs, n, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return cnt ? cnt : -1;
+        }
+        for (i = 0; i < n; i++) {
+            events = (short) (evs[i].data.u64 >> 32);
+            pds[cnt].fd = (int) (uint32_t) evs[i].data.u64;
+            pds[cnt].events = events;
+            pds[cnt].revents = (short) (evs[i].events & (events | POLLERR | POLLHUP));
+            cnt++;
+        }
+        if (n < ST_POLLSET_BATCH)
+            break;
+    }
+
+    return cnt;
+}
+
+/*
+ * 等待集合中的描述符就绪，把就绪的描述符(fd、关注的 events 与 revents)写入 pds，最多 npds 个
+ * 返回就绪的个数，超时返回 0。集合中的描述符是水平触发的，没有处理完的下一次还会返回
+ */
+int st_pollset_wait(_st_pollset_t *ps, struct pollfd *pds, int npds, st_utime_t timeout)
+{
+    st_utime_t deadline = 0, now;
+    int n;
+
+    if (npds <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (timeout != ST_UTIME_NO_TIMEOUT)
+        deadline = st_utime() + timeout;
+
+    for (;;) {
+        if ((n = _st_pollset_collect(ps, pds, npds)) != 0)
+            return n;
+
+        if (timeout != ST_UTIME_NO_TIMEOUT) {
+            now = st_utime();
+            timeout = (deadline > now) ? deadline - now : 0;
+            if (timeout == 0)
+                return 0;
+        }
+
+        /* 确实没有就绪的描述符，之后有描述符就绪时 epfd 一定会有新的事件，直接等待 */
+        ps->nfd->ready &= ~POLLIN;
+        if (st_netfd_poll(ps->nfd, POLLIN, timeout) < 0)
+            return (errno == ETIME) ? 0 : -1;
+    }
+}
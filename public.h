@@ -31,12 +31,88 @@ typedef struct _st_thread   *st_thread_t;
 typedef struct _st_cond     *st_cond_t;
 typedef struct _st_mutex    *st_mutex_t;
 typedef struct _st_netfd    *st_netfd_t;
+typedef struct _st_pollset  *st_pollset_t;
 
 /* 初始化 state-threads 系统，使用前必须先调用本函数 */
 extern int st_init();
 /* 获取最大打开文件数限制 */
 extern int st_getfdlimit();
 
+/*
+ * 额外启动 count 个 virtual processor(vp)，每个 vp 运行在一个独立的 OS 线程上，拥有自己的调度器、
+ * epoll 实例与栈缓存。每个新 vp 上会创建一个线程执行 start(arg)，该 vp 上的所有线程都结束后 OS 线程退出
+ * 线程、条件变量、mutex、netfd 只能在创建它们的 vp 上使用。进程级别的设置(st_key_create，
+ * st_set_utime_function，栈相关的开关等)应该在启动 vp 之前完成。返回成功启动的个数
+ */
+extern int st_vp_start(int count, void *(*start)(void *arg), void *arg);
+/* 当前 vp 的编号，调用 st_init 的第一个 vp 为 0 */
+extern int st_vp_id(void);
+
+/*
+ * 开启 vp 之间的 work stealing，返回之前的设置。开启后新创建的非 joinable 线程(没有指定
+ * ST_THREAD_PINNED 与 ST_THREAD_SHARED_STACK)在第一次运行前可以被空闲的 vp 窃取，在那个 vp 上运行到结束
+ * 这样的线程不能与创建它的 vp 上的线程共享条件变量、mutex 等对象
+ * 只有还没有运行过的线程会被窃取: 线程开始运行后就持有所在 vp 的状态(IO 队列、超时、等待队列)，不会再迁移，
+ * 所以已经在运行的线程阻塞、唤醒后仍然只在原来的 vp 上运行，不能用来平衡长时间运行的线程的负载
+ * 被窃取走的线程仍然计入创建它的 vp，它们全部结束之前这个 vp 不会结束(vp 0 结束时会退出进程)
+ */
+extern int st_work_stealing(int on);
+
+/*
+ * 强制轮询: 默认只有在没有可运行线程时才等待 IO 事件、检查超时，CPU 满载时它们可能长时间得不到处理
+ * 设置后每隔 switches 次线程切换或者 usecs 微秒(先到者为准，0 表示不使用该条件)，即使有可运行线程也会
+ * 不阻塞地收集一次 IO 事件并检查超时。按时间检查需要每次切换读取一次时钟，可以配合 st_set_clock_source 使用
+ * 更快的时钟。都为 0 时关闭(默认)
+ */
+extern int st_set_poll_interval(int switches, st_utime_t usecs);
+
+/*
+ * busy poll: 没有可运行线程时，先以 0 超时轮询 IO 事件最多 usecs 微秒再阻塞，省掉睡眠与唤醒的延迟，
+ * 代价是空闲时占用 CPU。实际自旋的时间根据最近的自旋是否等到了事件自动调整。usecs 为 0 时关闭(默认)
+ * ST_BUSY_POLL_SOCKET 对之后 st_netfd_open_socket 的 socket 设置 SO_BUSY_POLL
+ * ST_BUSY_POLL_EPOLL 对 epoll 实例设置内核的 busy poll 参数(Linux 6.9+)，两者在内核不支持或者没有权限时都会被忽略
+ */
+#define ST_BUSY_POLL_SOCKET 0x01
+#define ST_BUSY_POLL_EPOLL  0x02
+extern int st_set_busy_poll(st_utime_t usecs, int flags);
+
+/*
+ * 开启 runnext，返回之前的设置。开启后被 st_cond_signal 与 st_mutex_unlock 唤醒的线程不再排到可运行队列末尾，
+ * 而是在当前线程让出 CPU 后马上运行，适合生产者/消费者之间的交接。为了不饿死其他线程，连续这样运行的次数有上限
+ */
+extern int st_runnext(int on);
+
+/*
+ * 开启边沿触发，返回之前的设置。开启后 st_netfd_open_socket 与 st_accept 得到的 socket 在打开时以 EPOLLET
+ * 注册读写事件，直到关闭都不再修改，每次遇到 EAGAIN 等待时不再需要 epoll_ctl 添加、删除。只影响之后打开的 socket，
+ * 只在打开它的 vp 上生效(在其他 vp 上等待时与之前一样)。有线程正在等待时 st_netfd_close 返回 EBUSY
+ */
+extern int st_edge_triggered(int on);
+
+/*
+ * 当前 vp 的就绪缓存统计。边沿触发的 socket 记录事件系统报告的就绪状态，返回 EAGAIN 或者流式 socket
+ * 读到的比请求的少以后，在新的事件到达之前直接等待，不再调用注定返回 EAGAIN 的系统调用
+ */
+typedef struct st_io_stats {
+    unsigned long long eagain;         /* 返回 EAGAIN(未就绪)的 IO 系统调用次数 */
+    unsigned long long eagain_avoided; /* 根据就绪缓存直接等待而省掉的系统调用次数 */
+} st_io_stats_t;
+
+extern int st_io_stats(st_io_stats_t *stats);
+
+/*
+ * 选择事件系统，需要在 st_init 之前调用，之后返回 EBUSY。默认为 epoll
+ * io_uring 需要 Linux 5.11 以上，内核不支持或者被禁用时返回 ENOTSUP。使用 io_uring 时 st_read、st_write、
+ * st_accept 与 st_connect 直接把操作提交给内核，不再先试一次系统调用，其余的 IO 函数与 st_poll 仍然等待就绪，
+ * st_edge_triggered 与 st_set_busy_poll 不起作用。被打断时如果操作已经完成，返回结果，打断留给下一次阻塞调用
+ */
+#define ST_EVENTSYS_DEFAULT  0
+#define ST_EVENTSYS_EPOLL    1
+#define ST_EVENTSYS_IO_URING 2
+extern int st_set_eventsys(int eventsys);
+extern int st_get_eventsys(void);
+extern const char *st_get_eventsys_name(void);
+
 /* 获取当前线程的句柄 */
 extern st_thread_t st_thread_self();
 /* 退出当前线程，并且将 retval 作为返回值 */
@@ -45,15 +121,144 @@ extern void st_thread_exit(void *retval);
 extern int st_thread_join(st_thread_t thread, void **retvalp);
 /* 打断某个陷入阻塞的线程(注意这里的阻塞是指调用 state-threads 提供的阻塞接口) */
 extern void st_thread_interrupt(st_thread_t thread);
+/*
+ * 让出 CPU，当前线程排到可运行队列的末尾。没有其他可运行线程时先不阻塞地轮询一次 IO 与超时，
+ * 仍然没有就直接返回
+ */
+extern void st_thread_yield(void);
+/*
+ * 设置线程的运行预算: 每次被调度后连续运行超过 usecs 微秒，st_thread_should_yield 就返回 1
+ * 适合压缩、编码等长时间占用 CPU 的线程，在循环中检查并调用 st_thread_yield。0 表示不限制(默认)，返回之前的设置
+ */
+extern st_utime_t st_thread_budget(st_thread_t thread, st_utime_t usecs);
+extern int st_thread_should_yield(void);
 /* 创建线程 */
 extern st_thread_t st_thread_create(void *(*start)(void*), void *arg, int joinable, int stack_size);
+
+/* st_thread_create_ex 的 flags */
+/*
+ * 线程运行在少数几个共享运行栈上，被换出且运行栈需要让给其他线程时，用到的栈数据会被拷贝到
+ * 一块紧凑的堆内存中。适合海量且大部分时间处于空闲的线程，代价是切换时的内存拷贝
+ * 不支持该模式(ucontext 后端)或者 stack_size 超过共享运行栈大小时，退化为独立栈
+ */
+#define ST_THREAD_SHARED_STACK 0x01
+/* 线程固定在创建它的 vp 上运行，不会被其他 vp 窃取，见 st_work_stealing */
+#define ST_THREAD_PINNED       0x02
+
+/* 带 flags 的创建线程 */
+extern st_thread_t st_thread_create_ex(void *(*start)(void*), void *arg, int joinable, int stack_size, int flags);
+
+/* 共享栈的统计信息，平均每次切换的拷贝开销即 copy_bytes / copies */
+typedef struct st_shared_stack_stats {
+    int threads;                   /* 存活的共享栈线程数 */
+    size_t saved_bytes;            /* 当前保存在堆上的栈数据字节数 */
+    long long mem_saved;           /* 相比为每个线程分配独立栈节省的内存(字节) */
+    unsigned long long copies;     /* 发生栈拷贝的切换次数 */
+    unsigned long long copy_bytes; /* 累计拷贝的字节数(换出 + 换入) */
+} st_shared_stack_stats_t;
+
+extern int st_shared_stack_stats(st_shared_stack_stats_t *stats);
 /* 启动栈地址随机机制 */
 extern int st_randomize_stacks(int on);
+/* 启动弹性栈机制，栈只预留地址空间，在访问越界时自动增长，返回之前的设置 */
+extern int st_elastic_stacks(int on);
+
+/* 弹性栈的统计信息 */
+typedef struct st_elastic_stack_stats {
+    unsigned long long grows; /* 栈增长的次数 */
+    size_t peak_size;         /* 单个弹性栈曾经达到的最大提交大小 */
+    size_t committed;         /* 所有弹性栈(包括空闲的)当前提交的内存总量 */
+} st_elastic_stack_stats_t;
+
+extern int st_elastic_stack_stats(st_elastic_stack_stats_t *stats);
+
+/*
+ * 设置空闲栈缓存: 最多缓存 max_free 个空闲栈(-1 表示不限制)，超出的最冷的栈会被 munmap
+ * 空闲超过 idle_usecs 的栈会通过 madvise 释放物理内存(ST_UTIME_NO_TIMEOUT 表示不释放)
+ * 与 st_set_poll_interval 一样同时设置两个值，-1 又是合法的上限，所以不返回之前的设置:
+ * 成功返回 0，max_free 小于 -1 时返回 -1 并设置 errno 为 EINVAL
+ */
+extern int st_stack_cache_set(int max_free, st_utime_t idle_usecs);
+
+/*
+ * 预留 count 个 stack_size 大小(0 表示默认大小)的栈放入空闲链表，prefault 非 0 时预先分配物理内存
+ * (弹性栈只分配初始提交的部分)。可以在 st_init 之后、开始服务之前调用，避免第一批请求承担 mmap 与
+ * 缺页的开销。返回留在空闲链表中的个数，不会超过 st_stack_cache_set 设置的缓存上限
+ */
+extern int st_stack_pool_reserve(int count, int stack_size, int prefault);
+
+/*
+ * 栈 arena: 普通大小的栈从按 size class 划分的大块 mapping 中批量切分，减少 mmap 调用
+ * 默认每个栈下方保留一个保护页(相邻的栈共享)，栈溢出仍然会触发 SIGSEGV，但每个栈仍要一次 mprotect，
+ * 每个栈大约占用两个 VMA，也不能使用透明大页。ST_STACK_ARENA_NO_GUARD 不设置保护页，整个 arena 只有
+ * 一个 VMA，代价是栈溢出会悄悄覆盖相邻的栈，适合栈使用量已知(比如经过 st_stack_autotune 学习)的场景
+ * ST_STACK_ARENA_HUGEPAGE 对 arena 使用透明大页提示，只在同时设置了 ST_STACK_ARENA_NO_GUARD 时生效
+ * flags 为 0 关闭 arena，返回之前的设置，只影响之后新申请的栈
+ */
+#define ST_STACK_ARENA          0x01
+#define ST_STACK_ARENA_NO_GUARD 0x02
+#define ST_STACK_ARENA_HUGEPAGE 0x04
+extern int st_stack_arena(int flags);
+
+/* 栈 size class 的统计信息 */
+typedef struct st_stack_class_stats {
+    int size;                  /* 该 class 的栈大小，0 表示超过最大 class 的栈，-1 表示弹性栈 */
+    int nfree;                 /* 空闲栈个数 */
+    unsigned long long hits;   /* 从空闲链表复用的次数 */
+    unsigned long long misses; /* 需要新申请内存的次数 */
+} st_stack_class_stats_t;
+
+/* 获取最多 n 个 class 的统计信息，返回填充的个数 */
+extern int st_stack_class_stats(st_stack_class_stats_t *stats, int n);
+
+/* 开启栈染色，之后创建的线程可以通过 st_thread_stack_peak 获取栈的最大使用量，返回之前的设置 */
+extern int st_stack_painting(int on);
+/* 获取线程栈的最大使用量(字节)，栈没有染色时返回 -1 */
+extern int st_thread_stack_peak(st_thread_t thread);
+/*
+ * 开启栈大小自动调整，按 start 函数学习栈的最大使用量，采满 ST_STACK_AUTOTUNE_SAMPLES 个样本之后，
+ * 以 stack_size 为 0 创建的同一函数的线程使用学习到的大小(峰值加上一定余量)。学习阶段的线程使用
+ * 默认大小并自动染色，返回之前的设置
+ */
+extern int st_stack_autotune(int on);
 /* 设置时间获取函数 */
 extern int st_set_utime_function(st_utime_t (*func)());
 
+/*
+ * 内置的时钟，默认使用 ST_CLOCK_REALTIME(gettimeofday)，系统时间被调整时所有超时都会受影响
+ * ST_CLOCK_MONOTONIC 不受系统时间调整影响，ST_CLOCK_MONOTONIC_COARSE 读取更快但精度只有内核 tick
+ * ST_CLOCK_TSC 直接读取 CPU 计数器(x86_64 上要求 invariant TSC，选择时会花 10ms 校准)，不可用时返回 -1
+ * 后三种时钟的值与 CLOCK_MONOTONIC 一致，不是 unix 时间。和 st_set_utime_function 一样应该在 st_init 之前设置
+ */
+#define ST_CLOCK_REALTIME         0
+#define ST_CLOCK_MONOTONIC        1
+#define ST_CLOCK_MONOTONIC_COARSE 2
+#define ST_CLOCK_TSC              3
+extern int st_set_clock_source(int source);
+
+/*
+ * timer slack: 超时(sleep、条件变量、IO)允许被推迟最多 slack 微秒，截止时间向上对齐到 slack 的整数倍，
+ * 落在同一个窗口内的超时在同一次唤醒中一起到期，减少 epoll_wait 的唤醒次数。0 表示精确超时(默认)
+ * st_timer_slack 设置全局的 slack，st_thread_timer_slack 单独设置某个线程的 slack，
+ * ST_TIMER_SLACK_DEFAULT 表示使用全局设置。都返回之前的设置，只影响之后开始的等待
+ */
+#define ST_TIMER_SLACK_DEFAULT ((st_utime_t) -1LL)
+extern st_utime_t st_timer_slack(st_utime_t slack);
+extern st_utime_t st_thread_timer_slack(st_thread_t thread, st_utime_t slack);
+
+/* 当前 vp 的超时统计信息 */
+typedef struct st_timer_stats {
+    unsigned long long expired;       /* 到期的超时个数 */
+    unsigned long long wakeups;       /* 有超时到期的唤醒次数 */
+    unsigned long long coalesced;     /* 因为 slack 被推迟对齐的超时个数 */
+    unsigned long long wakeups_saved; /* 估计节省的唤醒次数(上限): 原截止时间处本需要单独唤醒的次数 */
+} st_timer_stats_t;
+
+extern int st_timer_stats(st_timer_stats_t *stats);
+
 /* 时间相关函数族 */
 extern st_utime_t st_utime();
+/* 调度器每一轮(每次检查超时)缓存的当前时间，不需要读取时钟，适合热路径上对精度要求不高的计时 */
 extern st_utime_t st_utime_last_clock();
 extern time_t st_time(void);
 extern int st_usleep(st_utime_t usecs);
@@ -92,6 +297,17 @@ extern int st_netfd_poll(st_netfd_t fd, int how, st_utime_t timeout);
 
 /* 下面的 st-xx 函数，基本可以认为是等同系统调用 xx */
 extern int st_poll(struct pollfd *pds, int npds, st_utime_t timeout);
+
+/*
+ * 持久的描述符集合，相当于线程自己的 epoll 实例。描述符增量地添加(已经存在时修改关注的事件，
+ * 可以是 POLLIN/POLLOUT/POLLPRI)与删除，st_pollset_wait 只返回就绪的描述符，每一轮等待的开销与集合大小无关
+ * 集合只在创建它的 vp 上使用，还有线程在等待时 st_pollset_free 返回 EBUSY
+ */
+extern st_pollset_t st_pollset_new(void);
+extern int st_pollset_free(st_pollset_t ps);
+extern int st_pollset_add(st_pollset_t ps, int osfd, int events);
+extern int st_pollset_del(st_pollset_t ps, int osfd);
+extern int st_pollset_wait(st_pollset_t ps, struct pollfd *pds, int npds, st_utime_t timeout);
 extern st_netfd_t st_accept(st_netfd_t fd, struct sockaddr *addr, int *addrlen, st_utime_t timeout);
 extern int st_connect(st_netfd_t fd, const struct sockaddr *addr, int addrlen, st_utime_t timeout);
 extern ssize_t st_read(st_netfd_t fd, void *buf, size_t nbyte, st_utime_t timeout);
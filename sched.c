@@ -6,47 +6,39 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "common.h"
 
-/* 全区变量 */
-_st_vp_t _st_this_vp;             /* virtual processor 单例 */
-_st_thread_t *_st_this_thread;    /* 当前运行的线程指针 */
-int _st_active_count = 0;         /* 系统未结束运行的线程数 */
+/* 全区变量，每个 vp(OS 线程) 一份 */
+_ST_TLS _st_vp_t _st_this_vp;             /* virtual processor */
+_ST_TLS _st_thread_t *_st_this_thread;    /* 当前运行的线程指针 */
+_ST_TLS int _st_active_count = 0;         /* vp 上未结束运行的线程数 */
 
-time_t _st_curr_time = 0;         /* 当前时间 */
-st_utime_t _st_last_tset;         /* 上一次获取时间 */
+_ST_TLS time_t _st_curr_time = 0;         /* 当前时间 */
+_ST_TLS st_utime_t _st_last_tset;         /* 上一次获取时间 */
 
-/* poll 这些描述符 */
-int st_poll(struct pollfd *pds, int npds, st_utime_t timeout) {
-    struct pollfd *pd;
-    struct pollfd *epd = pds + npds;
-    _st_pollq_t pq;
-    _st_thread_t *me = _ST_CURRENT_THREAD();
-    int n;
+static int _st_vp_next_id = 1;            /* 下一个 vp 的编号 */
+static _ST_TLS _st_thread_t *_st_vp_primordial; /* 额外启动的 vp 的原始线程，vp 结束时切换回去 */
 
-    if (me->flags & _ST_FL_INTERRUPT) {
-        /* 调用前被自己发送了信号，设置错误 */
-        me->flags &= ~_ST_FL_INTERRUPT;
-        errno = EINTR;
-        return -1;
-    }
+static void _st_steal_ring_init(void);
+static void _st_timer_wheel_init(st_utime_t now);
 
-    /* 向事件系统中添加描述符集合 */
-    if ((*_st_eventsys->pollset_add)(pds, npds) < 0) {
-        return -1;
-    }
+/* 把 pq 加入 IO 队列，等待事件、超时或者被打断，返回就绪的描述符个数 */
+static int _st_poll_wait(_st_pollq_t *pq, st_utime_t timeout) {
+    struct pollfd *pd;
+    struct pollfd *epd = pq->pds + pq->npds;
+    _st_thread_t *me = pq->thread;
+    int n;
 
     /* 添加到 IO 队列 */
-    pq.pds = pds;
-    pq.npds = npds;
-    pq.thread = me;
-    pq.on_ioq = 1;
-    _ST_ADD_IOQ(pq);
+    pq->on_ioq = 1;
+    _ST_ADD_IOQ((*pq));
 
     if (timeout != ST_UTIME_NO_TIMEOUT) {
-        /* 如果设置了超时，加入到休眠队列 */
-        _ST_ADD_SLEEPQ(me, timeout);
+        /* 如果设置了超时，加入到休眠队列或者时间轮 */
+        _ST_ADD_IO_TIMEOUT(me, timeout);
     }
     me->state = _ST_ST_IO_WAIT;
 
@@ -55,14 +47,14 @@ int st_poll(struct pollfd *pds, int npds, st_utime_t timeout) {
 
     /* 恢复执行了，检查我们是为什么返回 */
     n = 0;
-    if (pq.on_ioq) {
+    if (pq->on_ioq) {
         /* 还在 IOQ 中，说明要不然就是超时，要不然就是被打断，不管怎么样从 IOQ 删除 */
-        _ST_DEL_IOQ(pq);
-        (*_st_eventsys->pollset_del)(pds, npds);
+        _ST_DEL_IOQ((*pq));
+        (*_st_eventsys->pollset_del)(pq);
     } else {
         /* 触发了 IO 事件， 先遍历看看有多少事件被触发 */
-        for (pd = pds; pd != epd; pd++) {
-            if (pd->events) {
+        for (pd = pq->pds; pd != epd; pd++) {
+            if (pd->revents) {
                 n++;
             }
         }
@@ -75,19 +67,137 @@ int st_poll(struct pollfd *pds, int npds, st_utime_t timeout) {
         return -1;
     }
 
-    return 0;
+    return n;
 }
 
+/* poll 这些描述符 */
+int st_poll(struct pollfd *pds, int npds, st_utime_t timeout) {
+    _st_pollq_t pq_buf, *pq = &pq_buf;
+    _st_pollwait_t waits[ST_POLL_STACK_WAITS];
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+    int n, i, err;
+
+    if (me->flags & _ST_FL_INTERRUPT) {
+        /* 调用前被自己发送了信号，设置错误 */
+        me->flags &= ~_ST_FL_INTERRUPT;
+        errno = EINTR;
+        return -1;
+    }
+
+    if (me->flags & _ST_FL_SHARED_STACK) {
+        /*
+         * 共享栈线程换出后运行栈会被其他线程占用，链入事件系统的等待节点以及事件系统写入 revents 的 pds
+         * 都不能留在栈上，一起放到堆上，返回前再把 revents 拷贝回调用者的 pds
+         */
+        pq = (_st_pollq_t*) malloc(sizeof(_st_pollq_t) + npds * (sizeof(_st_pollwait_t) + sizeof(struct pollfd)));
+        if (!pq) {
+            errno = ENOMEM;
+            return -1;
+        }
+        pq->waits = (_st_pollwait_t*) (pq + 1);
+        pq->pds = (struct pollfd*) (pq->waits + npds);
+        memcpy(pq->pds, pds, npds * sizeof(struct pollfd));
+    } else {
+        pq->pds = pds;
+        pq->waits = waits;
+        if (npds > ST_POLL_STACK_WAITS && !(pq->waits = malloc(npds * sizeof(_st_pollwait_t)))) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    pq->npds = npds;
+    pq->thread = me;
+
+    /* 向事件系统中添加描述符集合，边沿触发的描述符可能已经就绪，这时不需要等待 */
+    if ((n = (*_st_eventsys->pollset_add)(pq)) == 0)
+        n = _st_poll_wait(pq, timeout);
+
+    err = errno;
+    if (pq != &pq_buf) {
+        for (i = 0; i < npds; i++)
+            pds[i].revents = pq->pds[i].revents;
+        free(pq);
+    } else if (pq->waits != waits) {
+        free(pq->waits);
+    }
+    errno = err;
+
+    return n;
+}
+
+/*****************************************
+ * runnext
+ * 被 st_cond_signal、st_mutex_unlock 唤醒的线程插在可运行队列头部，在唤醒者让出 CPU 后马上运行，
+ * 这时它要用到的数据(比如唤醒者刚刚写入的)很可能还在 cache 中。同一时刻只有一个这样的线程，
+ * 新的 runnext 会把之前的那个挤到队尾。与 Go 一样，这会让相互唤醒的一对线程一直占据 CPU，
+ * 所以连续运行 ST_RUNNEXT_MAX 次 runnext 后，把它移到队尾，让其他线程先运行
+ */
+
+int _st_runnext = 0;
+
+int st_runnext(int on) {
+    int wason = _st_runnext;
+
+    _st_runnext = on;
+    return wason;
+}
+
+void _st_add_runnext(_st_thread_t *thread) {
+    _st_thread_t *old = _st_this_vp.runnext;
+
+    if (old) {
+        /* 之前的 runnext 还没有运行，按普通的唤醒排到队尾 */
+        ST_REMOVE_LINK(&old->links);
+        _ST_ADD_RUNQ(old);
+    }
+    ST_INSERT_LINK(&thread->links, &_ST_RUNQ);
+    _st_this_vp.runnext = thread;
+}
+
+/* 可运行队列头部的线程，队列不能为空 */
+static inline _st_thread_t *_st_runq_head(void) {
+    _st_thread_t *thread = _ST_THREAD_PTR(_ST_RUNQ.next);
+
+    if (thread == _st_this_vp.runnext && _st_this_vp.runnext_streak >= ST_RUNNEXT_MAX &&
+        thread->links.next != &_ST_RUNQ) {
+        /* runnext 连续运行太多次了 */
+        ST_REMOVE_LINK(&thread->links);
+        _ST_ADD_RUNQ(thread);
+        _st_this_vp.runnext = NULL;
+        thread = _ST_THREAD_PTR(_ST_RUNQ.next);
+    }
+
+    return thread;
+}
+
+/* 线程从可运行队列中取出，记录连续运行 runnext 的次数 */
+#define _ST_RUNNEXT_TAKEN(_thread)                 \
+  ST_BEGIN_MACRO                                   \
+  if ((_thread) == _st_this_vp.runnext) {          \
+    _st_this_vp.runnext = NULL;                    \
+    _st_this_vp.runnext_streak++;                  \
+  } else {                                         \
+    _st_this_vp.runnext_streak = 0;                \
+  }                                                \
+  ST_END_MACRO
+
 /* 与源代码不同，我们这里要是一个循环 */
 void _st_vp_schedule() {
     _st_thread_t *thread;
 
     /* 只要还有未结束线程就一直执行 */
-    while (_st_active_count) {
+    for (;;) {
+        _ST_STEAL_REFILL();
+        _ST_POLL_CHECK();
+        /* 被其他 vp 窃取走的线程也要等它们结束，否则 vp 0 在这里 exit 会结束整个进程 */
+        if (!_st_active_count && !_ST_VP_LENT())
+            break;
         if (!ST_CLIST_IS_EMPTY(&(_ST_RUNQ))) {
             /* 可运行队列中有线程 */
-            thread = _ST_THREAD_PTR(_ST_RUNQ.next);
+            thread = _st_runq_head();
             _ST_DEL_RUNQ(thread);
+            _ST_RUNNEXT_TAKEN(thread);
+            _ST_PREFETCH(_ST_RUNQ.next);
         } else {
             /* 没有可运行线程，恢复执行 idle 线程 */
             thread = _st_this_vp.idle_thread;
@@ -95,25 +205,105 @@ void _st_vp_schedule() {
         /* thread 必然是可执行态 */
         assert(thread->state == _ST_ST_RUNNABLE);
         
+#ifndef ST_SWITCH_UCONTEXT
+        if ((thread->flags & _ST_FL_SHARED_STACK) && _st_shared_stack_swap_in(thread) < 0) {
+            /*
+             * 共享栈线程，必要时先把它的栈数据拷贝回运行栈。内存不足时运行栈的占用者换不出去，
+             * 放回可运行队列稍后重试，先运行其他线程
+             */
+            _ST_ADD_RUNQ(thread);
+            continue;
+        }
+#endif
+
         /* 恢复执行线程 */
         thread->state = _ST_ST_RUNNING;
+        _ST_SLICE_START(thread);
         _ST_RESTORE_CONTEXT(thread);
     }
 
-    /* 退出 */
+    /* 退出，额外启动的 vp 回到 _st_vp_main，只结束自己的 OS 线程 */
+    if (_st_vp_primordial)
+        _ST_RESTORE_CONTEXT(_st_vp_primordial);
     exit(0);
 }
 
-ucontext_t _st_schedule_context;
-/* 使用 ucontext 的话我们需要单独 init scheduler 的上下文 */
-static void _st_schedule_init() {
-    /* 这里就使用一个静态 buffer 作为 scheduler 的栈 */
-    static char buf[4095];
-    getcontext(&_st_schedule_context);
-    _st_schedule_context.uc_link = NULL;
-    _st_schedule_context.uc_stack.ss_size = sizeof(buf);
-    _st_schedule_context.uc_stack.ss_sp = buf;
-    makecontext(&_st_schedule_context, _st_vp_schedule, 0);
+/*
+ * 换出当前线程 me。原本每次让出 CPU 都要先切换到调度器，再由调度器切换到下一个线程，即两次上下文切换
+ * 这里直接从可运行队列中取出下一个线程并切换过去，只有可运行队列为空(需要执行 idle 线程)或者所有线程
+ * 都已经结束时才进入调度器
+ */
+void _st_vp_switch(_st_thread_t *me) {
+    _st_thread_t *thread;
+
+    _ST_STEAL_REFILL();
+    /*
+     * 退出中的线程已经把栈(和栈上的线程对象)交还，强制轮询会在这个栈上派发事件、回收空闲栈，
+     * 留给下一次切换去做
+     */
+    if (!(me->flags & _ST_FL_EXITING))
+        _ST_POLL_CHECK();
+    if (!_st_active_count || ST_CLIST_IS_EMPTY(&_ST_RUNQ)) {
+        _ST_MD_SWAP(&me->context, &_st_schedule_context);
+        return;
+    }
+
+    thread = _st_runq_head();
+    if ((thread->flags & _ST_FL_SHARED_STACK) && thread->stack->owner != thread) {
+        /* 需要拷贝共享栈，拷贝不能在运行栈上进行，交给调度器处理 */
+        _ST_MD_SWAP(&me->context, &_st_schedule_context);
+        return;
+    }
+    _ST_DEL_RUNQ(thread);
+    _ST_RUNNEXT_TAKEN(thread);
+    /* 预取下一个可运行线程，下次切换时它的热字段已经在 cache 中 */
+    _ST_PREFETCH(_ST_RUNQ.next);
+    assert(thread->state == _ST_ST_RUNNABLE);
+    thread->state = _ST_ST_RUNNING;
+    _ST_SLICE_START(thread);
+    if (thread == me) {
+        /* 自己又被放回了可运行队列并且排在最前面(比如让出 CPU 时没有其他可运行线程)，直接继续执行 */
+        return;
+    }
+
+    _ST_SET_CURRENT_THREAD(thread);
+    _ST_MD_SWAP(&me->context, &thread->context);
+}
+
+_ST_TLS _st_context_t _st_schedule_context;
+static _ST_TLS char *_st_schedule_stack;  /* scheduler 栈的 mapping，最低的一页是保护页 */
+
+/*
+ * 不使用 setjmp 的话我们需要单独 init scheduler 的上下文
+ * scheduler 栈上会派发事件、检查超时、回收与拷贝线程栈，所以单独 mmap 一个栈，栈底放一个保护页，
+ * 溢出时直接 SIGSEGV，而不是悄悄覆盖相邻的 TLS 数据。每个 OS 线程只申请一次
+ */
+static int _st_schedule_init() {
+    size_t guard = getpagesize();
+    size_t size = (ST_SCHED_STACK_SIZE + guard - 1) & ~(guard - 1);
+    char *vaddr;
+
+    if (!_st_schedule_stack) {
+        vaddr = (char*) mmap(NULL, guard + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (vaddr == MAP_FAILED)
+            return -1;
+        if (mprotect(vaddr, guard, PROT_NONE) < 0) {
+            munmap(vaddr, guard + size);
+            return -1;
+        }
+        _st_schedule_stack = vaddr;
+    }
+    _ST_MD_INIT(&_st_schedule_context, _st_schedule_stack + guard, size, _st_vp_schedule, NULL);
+    return 0;
+}
+
+/* 额外启动的 vp 结束时释放 scheduler 栈 */
+static void _st_schedule_fini() {
+    size_t guard = getpagesize();
+    size_t size = (ST_SCHED_STACK_SIZE + guard - 1) & ~(guard - 1);
+
+    munmap(_st_schedule_stack, guard + size);
+    _st_schedule_stack = NULL;
 }
 
 /* 初始化 virtual processor */
@@ -125,7 +315,9 @@ int st_init() {
         return 0;
     }
 
-    _st_schedule_init();
+    if (_st_schedule_init() < 0) {
+        return -1;
+    }
 
     /* 初始化 IO 系统 */
     if (_st_io_init() < 0) {
@@ -145,6 +337,13 @@ int st_init() {
 
     _st_this_vp.pagesize = getpagesize();
     _st_this_vp.last_clock = st_utime();
+    _st_this_vp.last_poll = _st_this_vp.last_clock;
+    _st_steal_ring_init();
+    _st_timer_wheel_init(_st_this_vp.last_clock);
+    /* 窃取来的线程可能使用弹性栈，每个 vp 都需要自己的信号栈 */
+    if (_st_stack_vp_init() < 0) {
+        return -1;
+    }
 
     /* 创建 idle 线程，没有其他可执行线程时，就会调度执行 idle */
     _st_this_vp.idle_thread = st_thread_create(_st_idle_thread_start, NULL, 0, 0);
@@ -172,6 +371,7 @@ int st_init() {
     /* 原始线程最开始处于 RUNNING，在调用 state-thread 的阻塞接口后，会开始调度其他线程 */
     thread->state = _ST_ST_RUNNING;
     thread->flags = _ST_FL_PRIMORDIAL;
+    thread->slack = ST_TIMER_SLACK_DEFAULT;
     _ST_SET_CURRENT_THREAD(thread);
     _st_active_count++;
 
@@ -183,15 +383,268 @@ void *_st_idle_thread_start(void *arg) {
     _st_thread_t *me = _ST_CURRENT_THREAD();
 
     for (; ;) {
+        /* 先尝试从其他 vp 窃取新线程，窃取到了就不需要等待 IO */
+        if (_st_work_stealing && _st_steal()) {
+            me->state = _ST_ST_RUNNABLE;
+            _ST_SWITCH_CONTEXT(me);
+            continue;
+        }
+
         /* 一直等待 IO 或者超时发生 */
         _ST_VP_IDLE();
 
         /* 看看是否是休眠队列中有超时的线程 */
         _st_vp_check_clock();
+        _st_this_vp.poll_tick = 0;
+        _st_this_vp.last_poll = _ST_LAST_CLOCK;
         
+        /* idle 线程不进入可运行队列，只在可运行队列为空时由调度器选中执行 */
         me->state = _ST_ST_RUNNABLE;
-        _ST_ADD_RUNQ(me);
+        _ST_SWITCH_CONTEXT(me);
+    }
+}
+
+/* 新 vp 的启动参数 */
+typedef struct _st_vp_start_arg {
+    int id;
+    void *(*start)(void *arg);
+    void *arg;
+} _st_vp_start_arg_t;
+
+/*
+ * 新 vp 的 OS 线程入口。start 在一个新创建的线程中执行，OS 线程本身(原始线程)不参与调度，
+ * 直接切换到调度器，等 vp 上所有线程结束后调度器再切换回来，OS 线程正常返回
+ */
+static void *_st_vp_main(void *p) {
+    _st_vp_start_arg_t a = *(_st_vp_start_arg_t*)p;
+    _st_thread_t *me;
+
+    free(p);
+    if (st_init() < 0)
+        return NULL;
+    _st_this_vp.id = a.id;
+
+    if (st_thread_create(a.start, a.arg, 0, 0) == NULL)
+        return NULL;
+
+    me = _ST_CURRENT_THREAD();
+    _st_vp_primordial = me;
+    _st_active_count--;
+    _ST_MD_SWAP(&me->context, &_st_schedule_context);
+
+    free(me);
+    _st_schedule_fini();
+    return NULL;
+}
+
+/* 额外启动 count 个 vp */
+int st_vp_start(int count, void *(*start)(void *arg), void *arg) {
+    _st_vp_start_arg_t *a;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int n;
+
+    if (count < 0 || start == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (n = 0; n < count; n++) {
+        if ((a = (_st_vp_start_arg_t*) malloc(sizeof(*a))) == NULL)
+            break;
+        a->id = __sync_fetch_and_add(&_st_vp_next_id, 1);
+        a->start = start;
+        a->arg = arg;
+        if ((errno = pthread_create(&tid, &attr, _st_vp_main, a)) != 0) {
+            free(a);
+            break;
+        }
     }
+    pthread_attr_destroy(&attr);
+
+    return (n == 0 && count > 0) ? -1 : n;
+}
+
+int st_vp_id(void) {
+    return _st_this_vp.id;
+}
+
+/*****************************************
+ * 强制轮询
+ * 调度器只在可运行队列为空时执行 idle 线程等待 IO，如果一直有可运行线程，IO 事件与超时就一直得不到处理
+ */
+
+int _st_poll_forced = 0;
+static int _st_poll_switches = 0;    /* 每隔多少次切换轮询一次，0 表示不按切换次数 */
+static st_utime_t _st_poll_usecs = 0; /* 每隔多少微秒轮询一次，0 表示不按时间 */
+
+int st_set_poll_interval(int switches, st_utime_t usecs) {
+    if (switches < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (usecs == ST_UTIME_NO_TIMEOUT)
+        usecs = 0;
+
+    _st_poll_switches = switches;
+    _st_poll_usecs = usecs;
+    _st_poll_forced = (switches || usecs);
+
+    return 0;
+}
+
+/* 不阻塞地收集一次 IO 事件并检查超时，就绪的线程排到可运行队列末尾 */
+static void _st_vp_poll_now(void) {
+    (*_st_eventsys->dispatch)(0);
+    _st_vp_check_clock();
+    _st_this_vp.poll_tick = 0;
+    _st_this_vp.last_poll = _ST_LAST_CLOCK;
+}
+
+/* 可运行队列不为空，到了轮询的间隔就轮询一次 */
+void _st_vp_poll(void) {
+    if (ST_CLIST_IS_EMPTY(&_ST_RUNQ)) {
+        /* 马上就会执行 idle 线程 */
+        return;
+    }
+
+    if ((_st_poll_switches && ++_st_this_vp.poll_tick >= (unsigned int) _st_poll_switches) ||
+        (_st_poll_usecs && st_utime() - _st_this_vp.last_poll >= _st_poll_usecs))
+        _st_vp_poll_now();
+}
+
+/*****************************************
+ * work stealing
+ * 只有还没有运行过的新线程会被窃取，它们不持有任何 vp 相关的状态(IO 队列，休眠堆，条件变量等)
+ */
+
+int _st_work_stealing = 0;
+int _st_steal_nrings = 0;                                /* 已注册的 steal_ring 个数 */
+static _st_steal_ring_t *_st_steal_rings[ST_MAX_VPS];    /* 所有 vp 的 steal_ring，不会被释放 */
+
+int st_work_stealing(int on) {
+    int wason = _st_work_stealing;
+
+    _st_work_stealing = on;
+    return wason;
+}
+
+/* 为当前 vp 创建并注册 steal_ring，超过 ST_MAX_VPS 的 vp 不参与 work stealing */
+static void _st_steal_ring_init(void) {
+    _st_steal_ring_t *r;
+    int i;
+
+    if (posix_memalign((void**)&r, _ST_CACHE_LINE, sizeof(*r)) != 0)
+        return;
+    memset(r, 0, sizeof(*r));
+
+    i = __atomic_fetch_add(&_st_steal_nrings, 1, __ATOMIC_RELAXED);
+    if (i >= ST_MAX_VPS) {
+        free(r);
+        return;
+    }
+    /* 发布之前 r 已经初始化完成 */
+    __atomic_store_n(&_st_steal_rings[i], r, __ATOMIC_RELEASE);
+    _st_this_vp.steal_ring = r;
+}
+
+/* 放入当前 vp 的 steal_ring，满了返回 -1，只有所属 vp 会调用 */
+static int _st_steal_ring_put(_st_steal_ring_t *r, _st_thread_t *thread) {
+    unsigned int h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int t = r->tail;
+
+    if (t - h >= ST_STEAL_RING_SIZE)
+        return -1;
+    r->buf[t & (ST_STEAL_RING_SIZE - 1)] = thread;
+    /* release 保证窃取者看到完整初始化的线程对象 */
+    __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* 所属 vp 从 steal_ring 中取出一个线程 */
+static _st_thread_t *_st_steal_ring_get(_st_steal_ring_t *r) {
+    unsigned int h, t;
+    _st_thread_t *thread;
+
+    for (;;) {
+        h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        t = r->tail;
+        if (t == h)
+            return NULL;
+        thread = r->buf[h & (ST_STEAL_RING_SIZE - 1)];
+        if (__atomic_compare_exchange_n(&r->head, &h, h + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return thread;
+    }
+}
+
+/* 把 steal_ring 中的一个线程移到可运行队列头部，被取出的线程从此时开始计入当前 vp 的活跃线程 */
+void _st_steal_refill(void) {
+    _st_thread_t *thread = _st_steal_ring_get(_st_this_vp.steal_ring);
+
+    if (thread) {
+        _st_active_count++;
+        ST_INSERT_LINK(&thread->links, &_ST_RUNQ);
+    }
+}
+
+/*
+ * 从其他 vp 的 steal_ring 中窃取一半的线程放入自己的 steal_ring，只在当前 vp 空闲(可运行队列与
+ * steal_ring 都为空)时调用。返回窃取到的线程数
+ */
+int _st_steal(void) {
+    _st_steal_ring_t *mine = _st_this_vp.steal_ring, *victim;
+    _st_thread_t *batch[ST_STEAL_RING_SIZE / 2];
+    unsigned int h, t, n, i;
+    int nrings, start, k;
+
+    if (!mine)
+        return 0;
+    nrings = __atomic_load_n(&_st_steal_nrings, __ATOMIC_RELAXED);
+    if (nrings > ST_MAX_VPS)
+        nrings = ST_MAX_VPS;
+    if (nrings < 2)
+        return 0;
+
+    /* 从随机位置开始遍历，避免所有空闲 vp 都去窃取同一个 vp */
+    start = (int)(random() % nrings);
+    for (k = 0; k < nrings; k++) {
+        victim = __atomic_load_n(&_st_steal_rings[(start + k) % nrings], __ATOMIC_ACQUIRE);
+        if (!victim || victim == mine)
+            continue;
+
+        for (;;) {
+            h = __atomic_load_n(&victim->head, __ATOMIC_ACQUIRE);
+            t = __atomic_load_n(&victim->tail, __ATOMIC_ACQUIRE);
+            n = t - h;
+            n = n - n / 2;
+            if (n == 0 || n > ST_STEAL_RING_SIZE / 2)
+                break;
+            for (i = 0; i < n; i++)
+                batch[i] = victim->buf[(h + i) & (ST_STEAL_RING_SIZE - 1)];
+            /*
+             * 先计入 victim 的 lent 再取走线程，victim 看到自己的 steal_ring 变空时一定也看得到计数，
+             * 不会在这些线程运行之前就认为所有线程都结束了
+             */
+            __atomic_add_fetch(&victim->lent, (int)n, __ATOMIC_RELAXED);
+            if (__atomic_compare_exchange_n(&victim->head, &h, h + n, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                /* 自己的 steal_ring 是空的，放得下 */
+                for (i = 0; i < n; i++) {
+                    if (batch[i]->lender)
+                        /* 再次被窃取，计数仍然留在创建它的 vp */
+                        __atomic_sub_fetch(&victim->lent, 1, __ATOMIC_RELAXED);
+                    else
+                        batch[i]->lender = victim;
+                    _st_steal_ring_put(mine, batch[i]);
+                }
+                return (int)n;
+            }
+            __atomic_sub_fetch(&victim->lent, (int)n, __ATOMIC_RELAXED);
+        }
+    }
+
+    return 0;
 }
 
 /* 退出线程 */
@@ -201,6 +654,10 @@ void st_thread_exit(void *retval) {
     me->retval = retval;
     _st_thread_cleanup(me);
     _st_active_count--;
+    if (me->lender) {
+        /* 被窃取来的线程，通知创建它的 vp 又有一个线程结束了 */
+        __atomic_sub_fetch(&me->lender->lent, 1, __ATOMIC_RELEASE);
+    }
     if (me->term) {
         /* 如果是 joinable 线程，不能直接销毁，要先进入 zombie 状态 */
         me->state = _ST_ST_ZOMBIE;
@@ -218,7 +675,13 @@ void st_thread_exit(void *retval) {
         me->term = NULL;
     }
 
-    if (!(me->flags & _ST_FL_PRIMORDIAL)) {
+    me->flags |= _ST_FL_EXITING;
+    if (me->flags & _ST_FL_SHARED_STACK) {
+        /* 共享栈线程对象在堆上，放回 free list 复用，运行栈不需要回收 */
+        _st_shared_thread_free(me);
+    } else if (!(me->flags & _ST_FL_PRIMORDIAL)) {
+        /* 记录栈的使用量用于自动调整栈大小 */
+        _st_stack_autotune_record((void*)me->start, me->stack);
         /* 
          * 如果不是原始线程，回收栈资源，注意，我们的 thread 对象其实就是占用了 stack 的部分空间
          * 所以回收了栈自然也就回收了 thread 对象，即 thread 对象本身也是复用的
@@ -272,8 +735,9 @@ int st_thread_join(_st_thread_t *thread, void **retvalp) {
      * 其实直接在这里做回收工作貌似也没有什么不可以的？
      * */
     thread->state = _ST_ST_RUNNABLE;
-    _ST_ADD_RUNQ(thread);
+    /* zombie 队列与可执行队列共用 links，必须先移出 zombie 队列 */
     _ST_DEL_ZOMBIEQ(thread);
+    _ST_ADD_RUNQ(thread);
 
     return 0;
 }
@@ -282,6 +746,9 @@ int st_thread_join(_st_thread_t *thread, void **retvalp) {
 void _st_thread_main() {
     _st_thread_t *thread = _ST_CURRENT_THREAD();
 
+    /* 线程开始运行后就不会再迁移到其他 vp，弹性栈从此归属当前 vp，缺页时按地址找到它 */
+    _st_stack_bind(thread->stack);
+
     /* 执行线程主体函数 */
     thread->retval = (*thread->start)(thread->arg);
 
@@ -299,7 +766,7 @@ static _st_thread_t **heap_insert(_st_thread_t *thread) {
     int index = 1;
 
     while (s) {
-        s >> 1;
+        s >>= 1;
         bits++;
     }
 
@@ -401,20 +868,248 @@ static void heap_delete(_st_thread_t *thread) {
     thread->left = thread->right = NULL;
 }
 
+/*****************************************
+ * 分层时间轮，用于大量的 IO 超时。插入与删除都是 O(1)，大部分 IO 超时在到期前就会被删除(IO 就绪)
+ * 与 Linux 经典的 timer wheel 相同: 第 0 层每个槽位对应一个 tick，第 i 层每个槽位对应第 i-1 层
+ * 的一整圈，第 0 层转完一圈时把上一层的当前槽位中的线程按照 due 重新放置(cascade)
+ */
+
+#define _ST_TW_L0_BITS 8
+#define _ST_TW_LN_BITS 6
+#define _ST_TW_L0_SIZE (1 << _ST_TW_L0_BITS)
+#define _ST_TW_LN_SIZE (1 << _ST_TW_LN_BITS)
+#define _ST_TW_LEVELS  4
+/* 时间轮能表示的最大 tick 差 */
+#define _ST_TW_MAX_DELTA ((1ULL << (_ST_TW_L0_BITS + (_ST_TW_LEVELS - 1) * _ST_TW_LN_BITS)) - 1)
+
+static _ST_TLS struct _st_timer_wheel {
+    unsigned long long curr;   /* 下一个要处理的 tick */
+    int count;                 /* 时间轮中的线程数 */
+    _st_clist_t l0[_ST_TW_L0_SIZE];
+    _st_clist_t ln[_ST_TW_LEVELS - 1][_ST_TW_LN_SIZE];
+} _st_timer_wheel;
+
+static void _st_timer_wheel_init(st_utime_t now) {
+    int i, j;
+
+    for (i = 0; i < _ST_TW_L0_SIZE; i++)
+        ST_INIT_CLIST(&_st_timer_wheel.l0[i]);
+    for (i = 0; i < _ST_TW_LEVELS - 1; i++)
+        for (j = 0; j < _ST_TW_LN_SIZE; j++)
+            ST_INIT_CLIST(&_st_timer_wheel.ln[i][j]);
+    _st_timer_wheel.curr = now / ST_TIMER_WHEEL_TICK;
+    _st_timer_wheel.count = 0;
+}
+
+/* 按照 thread->due 放入对应的槽位 */
+static void _st_timer_wheel_place(_st_thread_t *thread) {
+    struct _st_timer_wheel *tw = &_st_timer_wheel;
+    /* 向上取整，保证不会提前超时 */
+    unsigned long long expires = (thread->due + ST_TIMER_WHEEL_TICK - 1) / ST_TIMER_WHEEL_TICK;
+    unsigned long long delta;
+    int level, shift;
+
+    if (expires < tw->curr)
+        expires = tw->curr;
+    delta = expires - tw->curr;
+    if (delta > _ST_TW_MAX_DELTA) {
+        /* 超出时间轮的范围，先放在最远的位置，到时候重新放置 */
+        expires = tw->curr + _ST_TW_MAX_DELTA;
+        delta = _ST_TW_MAX_DELTA;
+    }
+
+    if (delta < _ST_TW_L0_SIZE) {
+        ST_APPEND_LINK(&thread->timer_links, &tw->l0[expires & (_ST_TW_L0_SIZE - 1)]);
+        return;
+    }
+    for (level = 0; level < _ST_TW_LEVELS - 1; level++) {
+        shift = _ST_TW_L0_BITS + (level + 1) * _ST_TW_LN_BITS;
+        if (level == _ST_TW_LEVELS - 2 || delta < (1ULL << shift))
+            break;
+    }
+    shift = _ST_TW_L0_BITS + level * _ST_TW_LN_BITS;
+    ST_APPEND_LINK(&thread->timer_links, &tw->ln[level][(expires >> shift) & (_ST_TW_LN_SIZE - 1)]);
+}
+
+/* 第 level 层(从 0 开始计数，不含第 0 层)的 index 槽位中的线程重新放置 */
+static int _st_timer_wheel_cascade(int level, int index) {
+    _st_clist_t list, *q;
+
+    if (ST_CLIST_IS_EMPTY(&_st_timer_wheel.ln[level][index]))
+        return index;
+
+    /* 先把整个槽位摘下来，重新放置的线程可能会回到同一个槽位 */
+    list = _st_timer_wheel.ln[level][index];
+    list.next->prev = &list;
+    list.prev->next = &list;
+    ST_INIT_CLIST(&_st_timer_wheel.ln[level][index]);
+
+    while (!ST_CLIST_IS_EMPTY(&list)) {
+        q = list.next;
+        ST_REMOVE_LINK(q);
+        _st_timer_wheel_place((_st_thread_t*)((char*)q - offsetof(_st_thread_t, timer_links)));
+    }
+
+    return index;
+}
+
+/* timer slack 与超时统计 */
+static st_utime_t _st_timer_slack = 0;
+static _ST_TLS st_timer_stats_t _st_timer_stats;
+static _ST_TLS st_utime_t _st_timer_last_pass; /* 上一次有超时到期的时间 */
+static _ST_TLS int _st_timer_pass_expired;      /* 本次检查中到期的超时个数 */
+static _ST_TLS int _st_timer_pass_saved;        /* 其中不推迟的话需要自己唤醒一次的个数 */
+
+/* 超时的线程恢复为可运行状态 */
+static void _st_timeout_expire(_st_thread_t *thread) {
+    _st_timer_pass_expired++;
+    if (thread->flags & _ST_FL_COALESCED) {
+        /* 原来的截止时间在上一次唤醒之后，不推迟的话就需要为它单独唤醒一次 */
+        if (thread->deadline > _st_timer_last_pass)
+            _st_timer_pass_saved++;
+        thread->flags &= ~_ST_FL_COALESCED;
+    }
+
+    /* 如果在等待条件变量，设置超时 flag 好让对方知道是超时 */
+    if (thread->state == _ST_ST_COND_WAIT) {
+        thread->flags |= _ST_FL_TIMEDOUT;
+    }
+
+    /* 绝不可能是 idle 线程在休眠 */
+    assert(!(thread->flags & _ST_FL_IDLE_THREAD));
+    /* 将超时线程恢复到可执行状态 */
+    thread->state = _ST_ST_RUNNABLE;
+    _ST_ADD_RUNQ(thread);
+}
+
+/* 推进时间轮到 now，唤醒所有到期的线程 */
+static void _st_timer_wheel_run(st_utime_t now) {
+    struct _st_timer_wheel *tw = &_st_timer_wheel;
+    unsigned long long target = now / ST_TIMER_WHEEL_TICK;
+    _st_thread_t *thread;
+    _st_clist_t *slot;
+    int index, level, shift;
+
+    if (tw->count == 0) {
+        /* 时间轮是空的，直接跳过中间的 tick */
+        if (target >= tw->curr)
+            tw->curr = target + 1;
+        return;
+    }
+
+    while (tw->curr <= target) {
+        index = (int)(tw->curr & (_ST_TW_L0_SIZE - 1));
+        if (index == 0) {
+            /* 第 0 层转完一圈，依次从上层 cascade */
+            for (level = 0; level < _ST_TW_LEVELS - 1; level++) {
+                shift = _ST_TW_L0_BITS + level * _ST_TW_LN_BITS;
+                if (_st_timer_wheel_cascade(level, (int)((tw->curr >> shift) & (_ST_TW_LN_SIZE - 1))) != 0)
+                    break;
+            }
+        }
+
+        slot = &tw->l0[index];
+        tw->curr++;
+        while (!ST_CLIST_IS_EMPTY(slot)) {
+            thread = (_st_thread_t*)((char*)slot->next - offsetof(_st_thread_t, timer_links));
+            if (thread->due > now) {
+                /* 超出范围被放在最远位置的线程，还没有真正到期 */
+                ST_REMOVE_LINK(&thread->timer_links);
+                _st_timer_wheel_place(thread);
+                continue;
+            }
+            _ST_DEL_SLEEPQ(thread);
+            _st_timeout_expire(thread);
+        }
+    }
+}
+
+/*
+ * 时间轮中最早可能到期的时间，只扫描第 0 层到本圈结束，没有找到就返回本圈结束的时间(需要 cascade)
+ * 返回值不会晚于真正的到期时间
+ */
+static st_utime_t _st_timer_wheel_next(void) {
+    struct _st_timer_wheel *tw = &_st_timer_wheel;
+    unsigned long long t, end = tw->curr | (_ST_TW_L0_SIZE - 1);
+
+    for (t = tw->curr; t <= end; t++) {
+        if (!ST_CLIST_IS_EMPTY(&tw->l0[t & (_ST_TW_L0_SIZE - 1)]))
+            return t * ST_TIMER_WHEEL_TICK;
+    }
+    return (end + 1) * ST_TIMER_WHEEL_TICK;
+}
+
+/*
+ * 下一个超时的时间，没有等待超时的线程时返回 ST_UTIME_NO_TIMEOUT。空闲栈等待释放物理内存时，
+ * 也不晚于下一次回收的时间，事件系统据此计算阻塞等待的时长
+ */
+st_utime_t _st_sleep_next_due(void) {
+    st_utime_t due = ST_UTIME_NO_TIMEOUT, wheel, trim;
+
+    if (_ST_SLEEPQ != NULL)
+        due = _ST_SLEEPQ->due;
+    if (_st_timer_wheel.count) {
+        wheel = _st_timer_wheel_next();
+        if (wheel < due)
+            due = wheel;
+    }
+    trim = _st_stack_trim_due();
+    if (trim < due)
+        due = trim;
+
+    return due;
+}
+
+/* 计算超时时间，有 slack 时向上对齐到 slack 的整数倍，同一个窗口内的超时会得到相同的截止时间 */
+static void _st_set_due(_st_thread_t *thread, st_utime_t timeout) {
+    st_utime_t slack = (thread->slack == ST_TIMER_SLACK_DEFAULT) ? _st_timer_slack : thread->slack;
+    st_utime_t due;
+
+    /* 注意这个时间是缓存 */
+    thread->due = _ST_LAST_CLOCK + timeout;
+    thread->flags &= ~_ST_FL_COALESCED;
+    if (slack > 1 && timeout != 0) {
+        due = (thread->due + slack - 1) / slack * slack;
+        if (due != thread->due) {
+            thread->deadline = thread->due;
+            thread->due = due;
+            thread->flags |= _ST_FL_COALESCED;
+            _st_timer_stats.coalesced++;
+        }
+    }
+}
+
 /* 添加休眠线程 */
 void _st_add_sleep_q(_st_thread_t *thread, st_utime_t timeout)
 {
-    /* 注意这个时间是缓存 */
-    thread->due = _ST_LAST_CLOCK + timeout;
+    _st_set_due(thread, timeout);
     thread->flags |= _ST_FL_ON_SLEEPQ;
     thread->heap_index = ++_ST_SLEEPQ_SIZE;
     heap_insert(thread);
 }
 
+/* 添加 IO 超时，短的超时仍然使用休眠堆以保证精度 */
+void _st_add_io_timeout(_st_thread_t *thread, st_utime_t timeout) {
+    if (timeout < ST_TIMER_WHEEL_MIN) {
+        _st_add_sleep_q(thread, timeout);
+        return;
+    }
+
+    _st_set_due(thread, timeout);
+    thread->flags |= _ST_FL_ON_SLEEPQ | _ST_FL_ON_WHEEL;
+    _st_timer_wheel.count++;
+    _st_timer_wheel_place(thread);
+}
+
 /* 从休眠队列删除 */
 void _st_del_sleep_q(_st_thread_t *thread) {
-    heap_delete(thread);
-    thread->flags &= ~_ST_FL_ON_SLEEPQ;
+    if (thread->flags & _ST_FL_ON_WHEEL) {
+        ST_REMOVE_LINK(&thread->timer_links);
+        _st_timer_wheel.count--;
+    } else {
+        heap_delete(thread);
+    }
+    thread->flags &= ~(_ST_FL_ON_SLEEPQ | _ST_FL_ON_WHEEL);
 }
 
 /* 检查休眠队列 */
@@ -432,6 +1127,9 @@ void _st_vp_check_clock() {
         _st_last_tset = now;
     }
 
+    /* 顺便回收空闲栈，当前线程的栈即使已经放回空闲链表(正在退出)也还在使用中 */
+    _st_stack_trim(now, _ST_CURRENT_THREAD()->stack);
+
     /* 遍历所有休眠线程 */
     while (_ST_SLEEPQ != NULL) {
         thread = _ST_SLEEPQ;
@@ -441,20 +1139,48 @@ void _st_vp_check_clock() {
             break;
         }
         _ST_DEL_SLEEPQ(thread);
+        _st_timeout_expire(thread);
+    }
 
-        /* 如果在等待条件变量，设置超时 flag 好让对方知道是超时 */
-        if (thread->state == _ST_ST_COND_WAIT) {
-            thread->flags |= _ST_FL_TIMEDOUT;
-        }
-
-        /* 绝不可能是 idle 线程在休眠 */
-        assert(!(thread->flags & _ST_FL_IDLE_THREAD));
-        /* 将超时线程恢复到可执行状态 */
-        thread->state = _ST_ST_RUNNABLE;
-        _ST_ADD_RUNQ(thread);
+    /* 时间轮中的 IO 超时 */
+    _st_timer_wheel_run(now);
+
+    if (_st_timer_pass_expired) {
+        /* 如果这次到期的都是被推迟的超时，这次唤醒本身不算节省 */
+        _st_timer_stats.expired += _st_timer_pass_expired;
+        _st_timer_stats.wakeups++;
+        _st_timer_stats.wakeups_saved += _st_timer_pass_saved -
+            (_st_timer_pass_saved == _st_timer_pass_expired ? 1 : 0);
+        _st_timer_last_pass = now;
+        _st_timer_pass_expired = 0;
+        _st_timer_pass_saved = 0;
     }
 }
 
+/* 设置全局 timer slack */
+st_utime_t st_timer_slack(st_utime_t slack) {
+    st_utime_t old = _st_timer_slack;
+
+    _st_timer_slack = (slack == ST_TIMER_SLACK_DEFAULT) ? 0 : slack;
+
+    return old;
+}
+
+/* 设置线程的 timer slack */
+st_utime_t st_thread_timer_slack(_st_thread_t *thread, st_utime_t slack) {
+    st_utime_t old = thread->slack;
+
+    thread->slack = slack;
+
+    return old;
+}
+
+/* 获取当前 vp 的超时统计信息 */
+int st_timer_stats(st_timer_stats_t *stats) {
+    *stats = _st_timer_stats;
+    return 0;
+}
+
 /* 
  * 打断某线程(类似于真正线程被 os 信号打断)，让其从阻塞操作中恢复
  * 并且设置 flags |= _ST_FL_INTERRUPT，如果对非阻塞线程调用此函数
@@ -483,49 +1209,159 @@ void st_thread_interrupt(_st_thread_t *thread) {
     _ST_ADD_RUNQ(thread);
 }
 
+/* 让出 CPU，排到可运行队列的末尾 */
+void st_thread_yield(void) {
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+
+    _ST_STEAL_REFILL();
+
+    if (ST_CLIST_IS_EMPTY(&_ST_RUNQ)) {
+        /*
+         * 没有其他可运行线程时不会经过 idle 线程，这里不阻塞地轮询一次，否则一直单独运行的线程
+         * 让出 CPU 时 IO 与超时永远得不到处理
+         */
+        _st_vp_poll_now();
+        if (ST_CLIST_IS_EMPTY(&_ST_RUNQ)) {
+            /* 仍然没有，继续执行，相当于开始了新的时间片 */
+            _ST_SLICE_START(me);
+            return;
+        }
+    } else if (st_thread_should_yield()) {
+        /* 时间片用完了，先把超时的线程放入可运行队列，让它们排在自己前面 */
+        _st_vp_check_clock();
+    }
+
+    me->state = _ST_ST_RUNNABLE;
+    _ST_ADD_RUNQ(me);
+    _ST_SWITCH_CONTEXT(me);
+}
+
+/* 设置线程的运行预算，返回之前的设置 */
+st_utime_t st_thread_budget(_st_thread_t *thread, st_utime_t usecs) {
+    st_utime_t old = thread->budget;
+
+    thread->budget = usecs;
+    if (usecs) {
+        thread->flags |= _ST_FL_BUDGET;
+        /* 正在运行的线程从现在开始计算 */
+        if (thread == _ST_CURRENT_THREAD())
+            thread->slice_start = st_utime();
+    } else {
+        thread->flags &= ~_ST_FL_BUDGET;
+    }
+
+    return old;
+}
+
+/* 当前线程这次被调度后的运行时间是否已经超出预算 */
+int st_thread_should_yield(void) {
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+
+    if (!(me->flags & _ST_FL_BUDGET))
+        return 0;
+
+    return st_utime() - me->slice_start >= me->budget;
+}
+
 /* 创建线程 */
 _st_thread_t *st_thread_create(void *(*start)(void *arg), void *arg, int joinable, int stk_size) {
+    return st_thread_create_ex(start, arg, joinable, stk_size, 0);
+}
+
+/* 带 flags 的创建线程，flags 见 public.h */
+_st_thread_t *st_thread_create_ex(void *(*start)(void *arg), void *arg, int joinable, int stk_size, int flags) {
     _st_thread_t *thread;
     _st_stack_t *stack;
     void **ptds;
     char *sp;
+    int stealable;
 
     if (stk_size == 0) {
-        stk_size = ST_DEFAULT_STACK_SIZE;
+        /* 没有指定栈大小时，优先使用为该 start 函数学习到的大小 */
+        stk_size = _st_stack_autotune_size((void*)start);
+        if (stk_size == 0)
+            stk_size = ST_DEFAULT_STACK_SIZE;
     }
     /* 调整栈大小为 pagsize 整数倍 */
     stk_size = ((stk_size + _ST_PAGE_SIZE - 1) / _ST_PAGE_SIZE) * _ST_PAGE_SIZE;
-    stack = _st_stack_new(stk_size);
-    if (!stack) {
-        return NULL;
+
+#ifdef ST_SWITCH_UCONTEXT
+    /* ucontext 后端不支持共享栈 */
+    flags &= ~ST_THREAD_SHARED_STACK;
+#endif
+    if (stk_size > ST_SHARED_STACK_SIZE) {
+        /* 共享运行栈放不下，只能使用独立栈 */
+        flags &= ~ST_THREAD_SHARED_STACK;
     }
+    /*
+     * 之后不再读取 flags: ucontext 后端的 getcontext 之后，被多次赋值的寄存器变量可能被破坏
+     * (-Wclobbered)，这里只保留一个单次赋值的结果
+     */
+    stealable = !joinable && !(flags & (ST_THREAD_PINNED | ST_THREAD_SHARED_STACK));
+
+    if (flags & ST_THREAD_SHARED_STACK) {
+        /* 共享栈线程对象分配在堆上，初始上下文已经构造好 */
+        thread = _st_shared_thread_new(stk_size);
+        if (!thread) {
+            return NULL;
+        }
+    } else {
+        stack = _st_stack_new(stk_size);
+        if (!stack) {
+            return NULL;
+        }
 
-    /* 栈上分配的数据还包括 st_thread_t，线程私有数据数组 */
-    sp = stack->stk_bottom;
-    thread = (_st_thread_t*) sp;
-    sp += sizeof(_st_thread_t);
-    ptds = (void**) sp;
-    sp += (ST_KEYS_MAX * sizeof(void*));
-    stack->sp = sp;
+        /*
+         * 栈上分配的数据还包括 st_thread_t，线程私有数据数组，它们放在栈顶，线程的栈从它们下方开始
+         * 向低地址增长。这样弹性栈只需要提交栈顶的一小段内存就可以开始运行
+         */
+        sp = stack->stk_top - sizeof(_st_thread_t) - ST_KEYS_MAX * sizeof(void*);
+        /* 线程对象按 cache line 对齐 */
+        sp = (char*)((unsigned long)sp & ~((unsigned long)_ST_CACHE_LINE - 1));
+        thread = (_st_thread_t*) sp;
+        ptds = (void**) (thread + 1);
+        stack->sp = sp;
+
+        if (_st_stack_paint_needed((void*)start)) {
+            _st_stack_paint(stack);
+        } else {
+            /* 复用的栈之前可能染过色，不再染色的话花纹就不可信了 */
+            stack->painted = 0;
+        }
 
-    /* 保证栈地址 64-bytes 对齐 */
-    if ((unsigned long)sp & 0x3f)
-        sp = sp + (0x40 - ((unsigned long)sp & 0x3f));
+        memset(thread, 0, sizeof(_st_thread_t));
+        memset(ptds, 0, ST_KEYS_MAX * sizeof(void*));
+        thread->stack = stack;
+        thread->private_data = ptds;
 
-    memset(thread, 0, sizeof(_st_thread_t));
-    memset(ptds, 0, ST_KEYS_MAX * sizeof(void*));
+        /* 初始化线程上下文 */
+        _ST_INIT_CONTEXT(thread, _st_thread_main);
+    }
 
     /* 设置字段 */
-    thread->stack = stack;
     thread->start = start;
     thread->arg = arg;
-    thread->private_data = ptds;
-
-    /* 初始化线程上下文 */
-    _ST_INIT_CONTEXT(thread, _st_thread_main);
+    thread->slack = ST_TIMER_SLACK_DEFAULT;
+
+    if (joinable) {
+        /* joinable 线程退出时通过这个条件变量通知 join 它的线程 */
+        thread->term = st_cond_new();
+        if (!thread->term) {
+            if (thread->flags & _ST_FL_SHARED_STACK)
+                _st_shared_thread_free(thread);
+            else
+                _st_stack_free(thread->stack);
+            return NULL;
+        }
+    }
 
     /* 新创建的线程都是可运行态 */
     thread->state = _ST_ST_RUNNABLE;
+    if (_st_work_stealing && _st_this_vp.steal_ring && _st_this_vp.idle_thread && stealable &&
+        _st_steal_ring_put(_st_this_vp.steal_ring, thread) == 0) {
+        /* 放入可被窃取的队列，被取出运行时才计入活跃线程 */
+        return thread;
+    }
     _st_active_count++;
     _ST_ADD_RUNQ(thread);
 
@@ -1,53 +1,194 @@
 /**
  * 栈实现代码。state-thread 的栈用一个全局的链表管理，当线程数较多（能低成本的创建很多线程，本身
  * 就是协程库存在的最主要意义之一) 且线程指定栈大小不一示，很可能造成内存浪费 + 性能问题（线性查找一个
- * 全局 list)。可能采取的优化措施：
- * 1. 采用多个 slots 分别管理某个大小的 stack 集合，可能更好，实现也并不复杂
+ * 全局 list)。这里采用多个 size class 分别管理某个大小的 stack 集合:
+ * 1. 栈大小向上取整为 2 的幂个 page，每个 class 一个 LIFO 的空闲链表，复用是 O(1) 的，也不会再把大栈
+ *    交给申请小栈的调用者
+ * 2. 超过最大 class 的栈放在 huge 链表中，只复用大小完全相同的栈
+ * 3. 弹性栈单独放在一个链表中，不与普通栈混用
+ * 4. 开启 arena 后，普通 class 的栈从该 class 的大块 mapping 中切分，而不是每个栈单独 mmap 一次
 */
 
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
 
 #include "common.h"
 
 /* 在栈的可用空间的头尾两端会保留 REDZONE 大小的空闲内存 */
 #define REDZONE _ST_PAGE_SIZE
 
-/* 栈对象用一个全局的 free list 管理，对资源进行复用 */
+/*
+ * 普通 class 的个数: 4 页以内逐页一个 class，之后每个 2 的幂区间 (2^k, 2^(k+1)] 页等分为 4 个 class，
+ * 栈最多比请求的大 25%。最大的 class 是 ST_STACK_CLASSES 个 2 的幂中最大的 (pagesize << (ST_STACK_CLASSES - 1))
+ */
+#define _ST_STACK_NORMAL_CLASSES (4 * (ST_STACK_CLASSES - 2))
+
+/* huge 与弹性栈链表在 class 数组中的下标 */
+#define _ST_STACK_CLASS_HUGE    _ST_STACK_NORMAL_CLASSES
+#define _ST_STACK_CLASS_ELASTIC (_ST_STACK_NORMAL_CLASSES + 1)
+#define _ST_STACK_NCLASSES      (_ST_STACK_NORMAL_CLASSES + 2)
+
+/* 栈对象按 size class 用 free list 管理，对资源进行复用，栈缓存是每个 vp 一份的，不需要加锁 */
 /* 注意这个链表什么的是一个 _st_clist_t 而不是 _st_stack_t */
-static _st_clist_t _st_free_stacks = ST_INIT_STATIC_CLIST(&_st_free_stacks);
-static int _st_num_free_stacks = 0;
+static _ST_TLS struct _st_stack_class {
+    _st_clist_t free_stacks;  /* 空闲栈，LIFO，刚释放的栈更可能还在 cache 中 */
+    int num_free;             /* 空闲栈个数 */
+    unsigned long long hits;  /* 从空闲链表复用的次数 */
+    unsigned long long misses;/* 需要新申请内存的次数 */
+    char *arena_next;         /* 当前 arena 中下一个可切分的栈 */
+    char *arena_end;
+    _st_clist_t spare;        /* 被淘汰的 arena 栈，内存已归还给内核，地址空间仍然保留 */
+} _st_stack_classes[_ST_STACK_NCLASSES];
+static _ST_TLS int _st_num_free_stacks = 0;
+static _ST_TLS st_utime_t _st_stack_last_trim = 0;
+static _ST_TLS int _st_stack_populate = 0; /* 新申请的栈使用 MAP_POPULATE 预先分配物理内存 */
+
+/* 以下是进程级别的设置，应该在启动其他 vp 之前设置好 */
+static int _st_max_free_stacks = -1;                         /* 每个 vp 的空闲栈缓存上限，-1 表示不限制 */
+static st_utime_t _st_stack_idle_usecs = ST_UTIME_NO_TIMEOUT; /* 空闲多久后释放栈的物理内存 */
 static int _st_randomize_stacks = 0;
+static int _st_elastic_stacks = 0;
+static int _st_stack_arena_flags = 0;
+
+/* 弹性栈的统计信息，每个 vp 一份 */
+static _ST_TLS unsigned long long _st_elastic_grows = 0;
+static _ST_TLS size_t _st_elastic_peak = 0;
+static _ST_TLS size_t _st_elastic_committed = 0;
+/* 在当前 vp 上运行过(运行中或者在空闲缓存中)的弹性栈，SIGSEGV handler 按出错地址在其中查找 */
+static _ST_TLS _st_stack_t *_st_elastic_list = NULL;
 
 static char *_st_new_stk_segment(int size);
+static char *_st_new_elastic_segment(int size, int commit);
+static void _st_stack_evict(_st_stack_t *keep);
+static void _st_stack_unbind(_st_stack_t *ts);
+static int _st_stack_fault_init(void);
+static char *_st_stack_arena_carve(struct _st_stack_class *sc, int stack_size);
+
+/* 普通 class 的栈大小(页数) */
+static int _st_stack_class_pages(int cls) {
+    if (cls < 4)
+        return cls + 1;
+    /* 第 cls / 4 + 1 个 2 的幂区间中的第 cls % 4 档，每档 2^(k-2) 页 */
+    return (cls % 4 + 5) << (cls / 4 - 1);
+}
+
+/* 计算 stack_size 所属的 class，并把 stack_size 调整为该 class 的栈大小 */
+static int _st_stack_class(int *stack_size, int elastic) {
+    int pages, k, step, cls;
+
+    if (elastic)
+        return _ST_STACK_CLASS_ELASTIC;
+
+    pages = (*stack_size + _ST_PAGE_SIZE - 1) / _ST_PAGE_SIZE;
+    if (pages > (1 << (ST_STACK_CLASSES - 1)))
+        return _ST_STACK_CLASS_HUGE;
+
+    if (pages <= 4) {
+        cls = (pages > 0 ? pages : 1) - 1;
+    } else {
+        /* 2^k < pages <= 2^(k+1)，向上取整到 2^(k-2) 的整数倍 */
+        k = 31 - __builtin_clz(pages - 1);
+        step = 1 << (k - 2);
+        cls = 4 * (k - 1) + (pages + step - 1) / step - 5;
+    }
+
+    *stack_size = _st_stack_class_pages(cls) * _ST_PAGE_SIZE;
+    return cls;
+}
 
 /* 申请一个 stack_size 大小的栈(返回的栈可用空间可能超过 stack_size) */
 _st_stack_t *_st_stack_new(int stack_size) {
+    struct _st_stack_class *sc;
     _st_clist_t *qp;
     _st_stack_t *ts;
-    int extra;
+    int extra, i;
+
+    if (_st_stack_classes[0].free_stacks.next == NULL) {
+        /* 第一次使用，初始化各个 class 的链表 */
+        for (i = 0; i < _ST_STACK_NCLASSES; i++) {
+            ST_INIT_CLIST(&_st_stack_classes[i].free_stacks);
+            ST_INIT_CLIST(&_st_stack_classes[i].spare);
+        }
+    }
+
+    if (_st_elastic_stacks) {
+        /* 每个 vp 第一次使用弹性栈时安装自己的信号栈 */
+        if (_st_stack_fault_init() < 0)
+            return NULL;
+        /* 弹性栈统一预留 ST_ELASTIC_STACK_RESERVE 的地址空间 */
+        if (stack_size < ST_ELASTIC_STACK_RESERVE)
+            stack_size = ST_ELASTIC_STACK_RESERVE;
+    }
+    sc = &_st_stack_classes[_st_stack_class(&stack_size, _st_elastic_stacks)];
 
-    /* 遍历空闲链表，看看是否有大小满足要求的栈 */
-    for (qp = _st_free_stacks.next; qp != &_st_free_stacks; qp = qp->next) {
+    /* 普通 class 中的栈大小都相同，直接取第一个，huge 与弹性栈的链表需要找到大小合适的 */
+    for (qp = sc->free_stacks.next; qp != &sc->free_stacks; qp = qp->next) {
         // 转型得到栈对象
         ts = _ST_THREAD_STACK_PTR(qp);
-        if (ts->stk_size >= stack_size) {
-            /* ok，找到了可以复用的栈，first fit 算法 */
+        if (ts->stk_size == stack_size || (sc == &_st_stack_classes[_ST_STACK_CLASS_ELASTIC] &&
+                                           ts->stk_size >= stack_size)) {
+            /* ok，找到了可以复用的栈 */
             ST_REMOVE_LINK(&ts->links);
+            sc->num_free--;
+            sc->hits++;
             _st_num_free_stacks--;
             ts->links.prev = ts->links.next = NULL;
+            /* 新线程可能被其他 vp 窃取，开始运行时再挂到运行它的 vp 上 */
+            _st_stack_unbind(ts);
             return ts;
         }
     }
+    sc->misses++;
+
+    if (_st_stack_arena_flags && sc < &_st_stack_classes[_ST_STACK_NORMAL_CLASSES]) {
+        /* 优先复用被淘汰的 arena 栈，否则从 arena 中切分一个新的 */
+        if (!ST_CLIST_IS_EMPTY(&sc->spare)) {
+            ts = _ST_THREAD_STACK_PTR(sc->spare.next);
+            ST_REMOVE_LINK(&ts->links);
+            ts->links.prev = ts->links.next = NULL;
+            return ts;
+        }
+        if ((ts = (_st_stack_t*) calloc(1, sizeof(_st_stack_t))) == NULL) {
+            return NULL;
+        }
+        if ((ts->vaddr = _st_stack_arena_carve(sc, stack_size)) == NULL) {
+            free(ts);
+            return NULL;
+        }
+        /* arena 中的栈不支持随机栈地址，栈底的保护页(如果有)属于 arena */
+        ts->arena = 1;
+        ts->vaddr_size = stack_size;
+        ts->stk_size = stack_size;
+        ts->stk_bottom = ts->vaddr;
+        ts->stk_top = ts->stk_bottom + stack_size;
+        return ts;
+    }
 
     /* 没有满足大小的栈，创建一个 */
     if ((ts = (_st_stack_t*) calloc(1, sizeof(_st_stack_t))) == NULL) {
         return NULL;
     }
-    extra = _st_randomize_stacks ? _ST_PAGE_SIZE : 0;
+    /* 弹性栈的栈顶就是线程对象，随机栈地址对其意义不大，这里不支持 */
+    extra = (_st_randomize_stacks && !_st_elastic_stacks) ? _ST_PAGE_SIZE : 0;
     // vaddr 包含: 栈，栈前后的 REDZONE，如果开启了随机栈地址，还需要额外申请一个 page
     ts->vaddr_size = stack_size + REDZONE*2 + extra;
-    ts->vaddr = _st_new_stk_segment(ts->vaddr_size);
+    if (_st_elastic_stacks) {
+        /* 初始只提交栈顶的 ST_ELASTIC_STACK_INIT 字节 */
+        ts->committed = ((ST_ELASTIC_STACK_INIT + _ST_PAGE_SIZE - 1) / _ST_PAGE_SIZE) * _ST_PAGE_SIZE;
+        if (ts->committed > stack_size)
+            ts->committed = stack_size;
+        ts->vaddr = _st_new_elastic_segment(ts->vaddr_size, ts->committed);
+        if (ts->vaddr) {
+            _st_elastic_committed += ts->committed;
+            if ((size_t)ts->committed > _st_elastic_peak)
+                _st_elastic_peak = ts->committed;
+        }
+    } else {
+        ts->vaddr = _st_new_stk_segment(ts->vaddr_size);
+    }
     if (!ts->vaddr) {
         free(ts);
         return NULL;
@@ -69,13 +210,177 @@ _st_stack_t *_st_stack_new(int stack_size) {
 
 /* 释放 ts */
 void _st_stack_free(_st_stack_t *ts) {
+    struct _st_stack_class *sc;
+    int stack_size;
+
     if (!ts) {
         return;
     }
 
-    /* 放回全局的空闲链表中 */
-    ST_APPEND_LINK(&ts->links, _st_free_stacks.prev);
+    stack_size = ts->stk_size;
+
+    /* 放回所属 class 的空闲链表头部 */
+    sc = &_st_stack_classes[_st_stack_class(&stack_size, ts->committed != 0)];
+    ST_INSERT_LINK(&ts->links, &sc->free_stacks);
+    sc->num_free++;
     _st_num_free_stacks++;
+    ts->free_time = _ST_LAST_CLOCK;
+    ts->trimmed = 0;
+
+    /*
+     * 超过缓存上限时释放最冷的栈。注意 ts 可能就是正在退出的线程自己的栈，不能释放，
+     * 释放不掉的部分留给 _st_stack_trim 处理
+     */
+    if (_st_max_free_stacks >= 0 && _st_num_free_stacks > _st_max_free_stacks)
+        _st_stack_evict(ts);
+}
+
+/* 真正释放一个栈的内存，arena 中的栈只归还物理内存，放入 spare 链表等待复用 */
+static void _st_stack_destroy(struct _st_stack_class *sc, _st_stack_t *ts) {
+    if (ts->arena) {
+        madvise(ts->stk_bottom, ts->stk_size, MADV_DONTNEED);
+        ts->painted = 0;
+        ts->trimmed = 1;
+        ST_APPEND_LINK(&ts->links, &sc->spare);
+        return;
+    }
+    if (ts->committed) {
+        _st_elastic_committed -= ts->committed;
+        _st_stack_unbind(ts);
+    }
+    munmap(ts->vaddr, ts->vaddr_size);
+    free(ts);
+}
+
+/* 从各个 class 的链表尾部(最冷的栈)开始释放空闲栈，直到不超过缓存上限，keep 不会被释放 */
+static void _st_stack_evict(_st_stack_t *keep) {
+    struct _st_stack_class *sc;
+    _st_stack_t *ts;
+    int i;
+
+    for (i = 0; i < _ST_STACK_NCLASSES && _st_num_free_stacks > _st_max_free_stacks; i++) {
+        sc = &_st_stack_classes[i];
+        while (!ST_CLIST_IS_EMPTY(&sc->free_stacks) && _st_num_free_stacks > _st_max_free_stacks) {
+            ts = _ST_THREAD_STACK_PTR(ST_LIST_TAIL(&sc->free_stacks));
+            if (ts == keep) {
+                if (ts->links.prev == &sc->free_stacks)
+                    break;
+                ts = _ST_THREAD_STACK_PTR(ts->links.prev);
+            }
+            ST_REMOVE_LINK(&ts->links);
+            sc->num_free--;
+            _st_num_free_stacks--;
+            _st_stack_destroy(sc, ts);
+        }
+    }
+}
+
+/* 释放空闲栈的物理内存，保留地址空间，栈再次被使用时按需缺页 */
+static void _st_stack_release(_st_stack_t *ts) {
+    char *start = (char*)(((unsigned long)ts->stk_bottom + _ST_PAGE_SIZE - 1) & ~((unsigned long)_ST_PAGE_SIZE - 1));
+    char *end = (char*)((unsigned long)ts->stk_top & ~((unsigned long)_ST_PAGE_SIZE - 1));
+    int init;
+
+    if (ts->committed) {
+        /* 弹性栈收缩回初始大小 */
+        init = ((ST_ELASTIC_STACK_INIT + _ST_PAGE_SIZE - 1) / _ST_PAGE_SIZE) * _ST_PAGE_SIZE;
+        if (ts->committed > init &&
+            mprotect(ts->stk_top - ts->committed, ts->committed - init, PROT_NONE) == 0) {
+            _st_elastic_committed -= ts->committed - init;
+            ts->committed = init;
+        }
+    }
+
+    madvise(start, end - start, ST_STACK_TRIM_ADVICE);
+    /* 释放后栈的内容不再可信 */
+    ts->painted = 0;
+    ts->trimmed = 1;
+}
+
+/*
+ * 后台回收，在 _st_vp_check_clock 中调用。空闲超过 _st_stack_idle_usecs 的栈释放物理内存，同时释放超过
+ * 缓存上限的栈。每个 class 的空闲链表是按释放时间排序的(头部最新)，被释放过物理内存的栈总是在尾部，
+ * 所以从头部开始遍历，遇到已经处理过的栈就可以停止
+ * keep 是调用者正在使用的栈(退出中的线程在最后一次切换前已经把栈放回了空闲链表)，不会被释放
+ */
+void _st_stack_trim(st_utime_t now, _st_stack_t *keep) {
+    struct _st_stack_class *sc;
+    _st_clist_t *qp;
+    _st_stack_t *ts;
+    int i;
+
+    if (_st_max_free_stacks >= 0 && _st_num_free_stacks > _st_max_free_stacks)
+        _st_stack_evict(keep);
+
+    if (_st_stack_idle_usecs == ST_UTIME_NO_TIMEOUT || now - _st_stack_last_trim < _st_stack_idle_usecs / 2)
+        return;
+    _st_stack_last_trim = now;
+
+    for (i = 0; i < _ST_STACK_NCLASSES; i++) {
+        sc = &_st_stack_classes[i];
+        for (qp = sc->free_stacks.next; qp != &sc->free_stacks; qp = qp->next) {
+            ts = _ST_THREAD_STACK_PTR(qp);
+            if (ts->trimmed)
+                break;
+            if (ts != keep && now - ts->free_time >= _st_stack_idle_usecs)
+                _st_stack_release(ts);
+        }
+    }
+}
+
+/*
+ * 下一次需要执行 _st_stack_trim 的时间，没有待释放的空闲栈时返回 ST_UTIME_NO_TIMEOUT。
+ * 回收只在 _st_vp_check_clock 中进行，空闲的 vp 要靠这个时间限制阻塞等待的时长，否则会一直持有这些内存
+ */
+st_utime_t _st_stack_trim_due(void) {
+    int i;
+
+    if (_st_stack_idle_usecs == ST_UTIME_NO_TIMEOUT || _st_num_free_stacks == 0)
+        return ST_UTIME_NO_TIMEOUT;
+
+    /* 头部的栈最新，它已经释放过物理内存的话整个链表都处理过了 */
+    for (i = 0; i < _ST_STACK_NCLASSES; i++) {
+        if (!ST_CLIST_IS_EMPTY(&_st_stack_classes[i].free_stacks) &&
+            !_ST_THREAD_STACK_PTR(_st_stack_classes[i].free_stacks.next)->trimmed)
+            return _st_stack_last_trim + _st_stack_idle_usecs / 2;
+    }
+    return ST_UTIME_NO_TIMEOUT;
+}
+
+/* 设置空闲栈缓存的上限与空闲栈释放物理内存的时间 */
+int st_stack_cache_set(int max_free, st_utime_t idle_usecs) {
+    if (max_free < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _st_max_free_stacks = max_free;
+    _st_stack_idle_usecs = idle_usecs;
+    /* 调用者是正在运行的线程，它的栈不在空闲链表中 */
+    _st_stack_trim(_ST_LAST_CLOCK, NULL);
+    return 0;
+}
+
+/* 获取各个 size class 的统计信息 */
+int st_stack_class_stats(st_stack_class_stats_t *stats, int n) {
+    int i;
+
+    if (n > _ST_STACK_NCLASSES)
+        n = _ST_STACK_NCLASSES;
+
+    for (i = 0; i < n; i++) {
+        if (i == _ST_STACK_CLASS_HUGE)
+            stats[i].size = 0;
+        else if (i == _ST_STACK_CLASS_ELASTIC)
+            stats[i].size = -1;
+        else
+            stats[i].size = _st_stack_class_pages(i) * _ST_PAGE_SIZE;
+        stats[i].nfree = _st_stack_classes[i].num_free;
+        stats[i].hits = _st_stack_classes[i].hits;
+        stats[i].misses = _st_stack_classes[i].misses;
+    }
+
+    return n;
 }
 
 /* 为栈申请内存 */
@@ -85,6 +390,9 @@ static char *_st_new_stk_segment(int size) {
     int mmap_flags = MAP_PRIVATE | MAP_ANON;
     void *vaddr;
 
+    if (_st_stack_populate)
+        mmap_flags |= MAP_POPULATE;
+
     vaddr = mmap(NULL, size, PROT_READ | PROT_WRITE, mmap_flags, zero_fd, 0);
     if (vaddr == (void*)MAP_FAILED) {
         return NULL;
@@ -97,6 +405,434 @@ static char *_st_new_stk_segment(int size) {
     return (char*) vaddr;
 }
 
+/*
+ * 从 sc 的 arena 中切分一个 stack_size 大小的栈，返回栈底地址。arena 的布局是
+ * [保护页][栈][保护页][栈]...[栈][保护页]，相邻的栈共享中间的保护页，每个栈下方都有一个保护页，
+ * 栈溢出仍然会触发 SIGSEGV。当前 arena 用完后再申请一个新的，arena 不会被释放
+ * 保护页把 arena 拆成了每个栈两个 VMA，透明大页也无从谈起，所以大页提示只用于没有保护页的 arena
+ */
+static char *_st_stack_arena_carve(struct _st_stack_class *sc, int stack_size) {
+    int guard = (_st_stack_arena_flags & ST_STACK_ARENA_NO_GUARD) ? 0 : REDZONE;
+    int slot = stack_size + guard;
+    size_t size;
+    char *vaddr;
+    int i, n;
+
+    if (sc->arena_next == NULL || sc->arena_end - sc->arena_next < slot) {
+        n = (ST_STACK_ARENA_SIZE - guard) / slot;
+        if (n < 1)
+            n = 1;
+        size = (size_t)n * slot + guard;
+
+        vaddr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANON | (_st_stack_populate ? MAP_POPULATE : 0), -1, 0);
+        if (vaddr == (char*)MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (!guard && (_st_stack_arena_flags & ST_STACK_ARENA_HUGEPAGE))
+            madvise(vaddr, size, MADV_HUGEPAGE);
+#endif
+        if (guard) {
+            for (i = 0; i <= n; i++)
+                mprotect(vaddr + (size_t)i * slot, guard, PROT_NONE);
+        }
+
+        sc->arena_next = vaddr + guard;
+        sc->arena_end = vaddr + size;
+    }
+
+    vaddr = sc->arena_next;
+    sc->arena_next += slot;
+    return vaddr;
+}
+
+/*
+ * 预留 count 个 size 大小的栈放入空闲链表(已有的空闲栈也计算在内)，之后创建的线程直接复用。
+ * 线程对象就在栈顶，所以这同时也预留了线程对象。prefault 时新申请的栈使用 MAP_POPULATE，
+ * 复用的栈与从已有 arena 中切分的栈则逐页写一次(写回原来的值，不破坏染色)。弹性栈只预先分配
+ * 已提交的部分，其余的仍然按需增长
+ * 空闲栈缓存有上限时，超出上限的栈直接释放，不会为了放下它们而淘汰其他空闲栈，返回实际留在缓存中的个数
+ */
+int st_stack_pool_reserve(int count, int size, int prefault) {
+    struct _st_stack_class *sc;
+    _st_clist_t reserved;
+    _st_stack_t *ts;
+    char *p, *low;
+    int n, kept, stack_size;
+
+    if (count < 0 || size < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (size == 0)
+        size = ST_DEFAULT_STACK_SIZE;
+    /* 与 st_thread_create 一样调整为 pagesize 整数倍，保证落入同一个 class */
+    size = ((size + _ST_PAGE_SIZE - 1) / _ST_PAGE_SIZE) * _ST_PAGE_SIZE;
+
+    ST_INIT_CLIST(&reserved);
+    _st_stack_populate = prefault;
+    for (n = 0; n < count; n++) {
+        if ((ts = _st_stack_new(size)) == NULL)
+            break;
+        if (prefault) {
+            /* 弹性栈只能访问已提交的部分 */
+            low = ts->committed ? ts->stk_top - ts->committed : ts->stk_bottom;
+            for (p = ts->stk_top - _ST_PAGE_SIZE; p >= low; p -= _ST_PAGE_SIZE)
+                *(volatile char*)p = *(volatile char*)p;
+        }
+        ST_APPEND_LINK(&ts->links, &reserved);
+    }
+    _st_stack_populate = 0;
+
+    kept = 0;
+    while (!ST_CLIST_IS_EMPTY(&reserved)) {
+        ts = _ST_THREAD_STACK_PTR(reserved.next);
+        ST_REMOVE_LINK(&ts->links);
+        if (_st_max_free_stacks >= 0 && _st_num_free_stacks >= _st_max_free_stacks) {
+            stack_size = ts->stk_size;
+            sc = &_st_stack_classes[_st_stack_class(&stack_size, ts->committed != 0)];
+            _st_stack_destroy(sc, ts);
+            continue;
+        }
+        _st_stack_free(ts);
+        kept++;
+    }
+
+    return kept;
+}
+
+/* 设置栈 arena，返回之前的设置 */
+int st_stack_arena(int flags) {
+    int old = _st_stack_arena_flags;
+    int i;
+
+    if ((flags & ST_STACK_ARENA_NO_GUARD) != (old & ST_STACK_ARENA_NO_GUARD)) {
+        /* 保护页的设置变了，已有 arena 的剩余空间按旧的布局切分过，不能再用 */
+        for (i = 0; i < _ST_STACK_NCLASSES; i++)
+            _st_stack_classes[i].arena_next = _st_stack_classes[i].arena_end = NULL;
+    }
+    _st_stack_arena_flags = flags;
+
+    return old;
+}
+
+/* 为弹性栈申请内存，整段地址空间都是 PROT_NONE，只有栈顶 REDZONE 下方的 commit 字节可读写 */
+static char *_st_new_elastic_segment(int size, int commit) {
+    void *vaddr;
+
+    vaddr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (vaddr == (void*)MAP_FAILED) {
+        return NULL;
+    }
+
+    if (mprotect((char*)vaddr + size - REDZONE - commit, commit, PROT_READ | PROT_WRITE) < 0) {
+        munmap(vaddr, size);
+        return NULL;
+    }
+
+    return (char*) vaddr;
+}
+
+/*
+ * 把弹性栈挂到当前 vp 的链表上。链表只会被当前 OS 线程修改，handler 也运行在这个 OS 线程上，
+ * 可能在修改的中途被打断，所以 next 方向的链接总是一次性写入，handler 只沿 next 遍历
+ */
+void _st_stack_bind(_st_stack_t *ts) {
+    if (!ts || !ts->committed || ts->elastic_prev)
+        return;
+
+    ts->elastic_next = _st_elastic_list;
+    ts->elastic_prev = &_st_elastic_list;
+    if (ts->elastic_next)
+        ts->elastic_next->elastic_prev = &ts->elastic_next;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    _st_elastic_list = ts;
+}
+
+static void _st_stack_unbind(_st_stack_t *ts) {
+    if (!ts->elastic_prev)
+        return;
+
+    *ts->elastic_prev = ts->elastic_next;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (ts->elastic_next)
+        ts->elastic_next->elastic_prev = ts->elastic_prev;
+    ts->elastic_next = NULL;
+    ts->elastic_prev = NULL;
+}
+
+/* 按地址查找出错的弹性栈 */
+static _st_stack_t *_st_stack_lookup(char *addr) {
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+    _st_stack_t *ts = me ? me->stack : NULL;
+
+    /*
+     * 绝大多数情况下是当前线程的栈。但切换时 current 在真正切换之前就已经指向了下一个线程，
+     * 正在换出的线程保存上下文时也可能缺页，所以不在当前线程栈内的地址还要查找整个链表
+     */
+    if (ts && ts->committed && addr >= ts->vaddr && addr < ts->vaddr + ts->vaddr_size)
+        return ts;
+    for (ts = _st_elastic_list; ts; ts = ts->elastic_next) {
+        if (addr >= ts->vaddr && addr < ts->vaddr + ts->vaddr_size)
+            return ts;
+    }
+    return NULL;
+}
+
+/*
+ * 弹性栈增长。线程的栈访问越过了已提交区域时会触发 SIGSEGV，handler 运行在 sigaltstack 上，
+ * 如果出错地址落在某个弹性栈的未提交区间内，就提交更多内存(至少翻倍)后返回，重新执行出错的指令
+ * 否则(包括真正的栈溢出，即访问到了栈底的 REDZONE)交给原来的 handler 处理，自己保持安装
+ */
+static struct sigaction _st_old_segv_action;
+
+static void _st_stack_fault_handler(int sig, siginfo_t *info, void *context) {
+    char *addr = (char*) info->si_addr;
+    _st_stack_t *ts = _st_stack_lookup(addr);
+    struct sigaction dfl;
+    char *low;
+    int committed;
+
+    if (ts && addr >= ts->stk_bottom && addr < ts->stk_top - ts->committed) {
+        committed = ts->committed * 2;
+        if (committed < ts->stk_top - addr)
+            committed = (int)(ts->stk_top - addr);
+        committed = ((committed + _ST_PAGE_SIZE - 1) / _ST_PAGE_SIZE) * _ST_PAGE_SIZE;
+        if (committed > ts->stk_size)
+            committed = ts->stk_size;
+
+        low = ts->stk_top - committed;
+        if (mprotect(low, committed - ts->committed, PROT_READ | PROT_WRITE) == 0) {
+            _st_elastic_grows++;
+            _st_elastic_committed += committed - ts->committed;
+            ts->committed = committed;
+            if ((size_t)committed > _st_elastic_peak)
+                _st_elastic_peak = committed;
+            return;
+        }
+    }
+
+    if (_st_old_segv_action.sa_flags & SA_SIGINFO) {
+        (*_st_old_segv_action.sa_sigaction)(sig, info, context);
+    } else if (_st_old_segv_action.sa_handler != SIG_DFL && _st_old_segv_action.sa_handler != SIG_IGN) {
+        (*_st_old_segv_action.sa_handler)(sig);
+    } else {
+        /* 默认处理(同步产生的 SIGSEGV 不能忽略): 恢复默认行为，返回后再次触发，进程按默认方式终止 */
+        memset(&dfl, 0, sizeof(dfl));
+        dfl.sa_handler = SIG_DFL;
+        sigaction(SIGSEGV, &dfl, NULL);
+    }
+}
+
+/*
+ * 安装 sigaltstack 与 SIGSEGV handler。信号栈是每个 OS 线程一个的，每个 vp 都要安装一次，
+ * handler 是进程级别的，只需要安装一次
+ */
+static int _st_stack_fault_init(void) {
+    static _ST_TLS int altstack_inited = 0;
+    static int inited = 0;
+    struct sigaction sa;
+    stack_t ss;
+
+    if (!altstack_inited) {
+        /* 栈溢出时当前栈已经不可用，handler 必须运行在单独的信号栈上 */
+        if ((ss.ss_sp = malloc(ST_SIGALTSTACK_SIZE)) == NULL)
+            return -1;
+        ss.ss_size = ST_SIGALTSTACK_SIZE;
+        ss.ss_flags = 0;
+        if (sigaltstack(&ss, NULL) < 0) {
+            free(ss.ss_sp);
+            return -1;
+        }
+        altstack_inited = 1;
+    }
+
+    if (inited)
+        return 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = _st_stack_fault_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, &_st_old_segv_action) < 0)
+        return -1;
+
+    inited = 1;
+    return 0;
+}
+
+/* vp 初始化时调用，开启了弹性栈时安装当前 OS 线程的信号栈 */
+int _st_stack_vp_init(void) {
+    return _st_elastic_stacks ? _st_stack_fault_init() : 0;
+}
+
+/*
+ * 开启弹性栈机制，之后创建的线程的栈只预留地址空间，按需增长，见 _st_stack_fault_handler
+ * 注意已经在 free list 中的栈不受影响
+ */
+int st_elastic_stacks(int on) {
+    int wason = _st_elastic_stacks;
+
+    if (on && _st_stack_fault_init() < 0)
+        return -1;
+    _st_elastic_stacks = on;
+
+    return wason;
+}
+
+/* 获取弹性栈的统计信息 */
+int st_elastic_stack_stats(st_elastic_stack_stats_t *stats) {
+    stats->grows = _st_elastic_grows;
+    stats->peak_size = _st_elastic_peak;
+    stats->committed = _st_elastic_committed;
+    return 0;
+}
+
+/*****************************************
+ * 栈染色与栈大小自动调整。染色即在栈的可用空间中填满固定的花纹，线程运行过的地方花纹会被破坏，从栈底向上
+ * 找到第一个被破坏的字就得到了栈的最大使用量。染色会让整个栈都驻留内存，所以自动调整只在学习阶段对线程染色
+ */
+
+#define _ST_STACK_PAINT 0x5354535453545354UL
+
+static int _st_paint_stacks = 0;
+static int _st_autotune_stacks = 0;
+
+/* 按 start 函数记录的栈使用峰值，每个 vp 单独学习，不需要加锁 */
+static _ST_TLS struct _st_stack_autotune {
+    void *key;   /* start 函数 */
+    int peak;    /* 采样到的最大使用量 */
+    int samples; /* 采样次数 */
+} _st_autotune_table[ST_STACK_AUTOTUNE_SLOTS];
+
+/* 栈的可用区间的低地址，弹性栈只有已提交的部分可以访问 */
+#define _ST_STACK_LOW(ts) \
+    ((unsigned long *)((ts)->committed ? (ts)->stk_top - (ts)->committed : (ts)->stk_bottom))
+
+static struct _st_stack_autotune *_st_stack_autotune_find(void *key, int insert) {
+    unsigned long h = ((unsigned long)key >> 4) % ST_STACK_AUTOTUNE_SLOTS;
+    int i;
+
+    /* 线性探测，槽位用满后新的函数不再学习 */
+    for (i = 0; i < ST_STACK_AUTOTUNE_SLOTS; i++) {
+        struct _st_stack_autotune *e = &_st_autotune_table[(h + i) % ST_STACK_AUTOTUNE_SLOTS];
+        if (e->key == key)
+            return e;
+        if (e->key == NULL) {
+            if (!insert)
+                return NULL;
+            e->key = key;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* 以 key 为 start 函数创建的线程是否需要染色 */
+int _st_stack_paint_needed(void *key) {
+    struct _st_stack_autotune *e;
+
+    if (_st_paint_stacks)
+        return 1;
+    if (!_st_autotune_stacks)
+        return 0;
+
+    e = _st_stack_autotune_find(key, 0);
+    return !e || e->samples < ST_STACK_AUTOTUNE_SAMPLES;
+}
+
+/* 对 [低地址, 初始栈指针) 染色，复用的栈只需要重新染色上次被用过的部分 */
+void _st_stack_paint(_st_stack_t *ts) {
+    unsigned long *p = _ST_STACK_LOW(ts);
+    unsigned long *end = (unsigned long *) ts->sp;
+
+    if (ts->painted) {
+        while (p < end && *p == _ST_STACK_PAINT)
+            p++;
+    }
+    while (p < end)
+        *p++ = _ST_STACK_PAINT;
+    ts->painted = 1;
+}
+
+/*
+ * 获取栈的最大使用量。弹性栈增长出来的页面没有染色，会被当作全部用过，所以结果是按页向上取整的
+ */
+int _st_stack_peak(_st_stack_t *ts) {
+    unsigned long *p = _ST_STACK_LOW(ts);
+    unsigned long *end = (unsigned long *) ts->sp;
+
+    if (!ts->painted)
+        return -1;
+
+    while (p < end && *p == _ST_STACK_PAINT)
+        p++;
+
+    return (int)((char *)end - (char *)p);
+}
+
+/*
+ * 返回为 key 学习到的栈大小，样本数还不够 ST_STACK_AUTOTUNE_SAMPLES 时返回 0(使用默认大小)。
+ * 只看过一两次的峰值可能没有走到深的调用路径，过早缩小会让后面的线程栈溢出
+ */
+int _st_stack_autotune_size(void *key) {
+    struct _st_stack_autotune *e;
+    int size;
+
+    if (!_st_autotune_stacks || (e = _st_stack_autotune_find(key, 0)) == NULL ||
+        e->samples < ST_STACK_AUTOTUNE_SAMPLES)
+        return 0;
+
+    /* 线程对象与私有数据也在栈上 */
+    size = e->peak + e->peak / 100 * ST_STACK_AUTOTUNE_MARGIN + 
+        sizeof(_st_thread_t) + ST_KEYS_MAX * sizeof(void*) + _ST_PAGE_SIZE;
+    return ((size + _ST_PAGE_SIZE - 1) / _ST_PAGE_SIZE) * _ST_PAGE_SIZE;
+}
+
+/* 线程退出时记录其栈使用量 */
+void _st_stack_autotune_record(void *key, _st_stack_t *ts) {
+    struct _st_stack_autotune *e;
+    int peak;
+
+    if (!_st_autotune_stacks || (peak = _st_stack_peak(ts)) < 0)
+        return;
+    if ((e = _st_stack_autotune_find(key, 1)) == NULL)
+        return;
+
+    if (peak >= (char *)ts->sp - (char *)_ST_STACK_LOW(ts)) {
+        /* 整个栈都被用完了，说明栈太小，测不到真正的峰值，按照翻倍处理 */
+        peak *= 2;
+    }
+    if (peak > e->peak)
+        e->peak = peak;
+    e->samples++;
+}
+
+/* 开启栈染色 */
+int st_stack_painting(int on) {
+    int wason = _st_paint_stacks;
+
+    _st_paint_stacks = on;
+    return wason;
+}
+
+/* 获取线程栈的最大使用量 */
+int st_thread_stack_peak(_st_thread_t *thread) {
+    if (thread->flags & (_ST_FL_PRIMORDIAL | _ST_FL_SHARED_STACK))
+        return -1;
+    return _st_stack_peak(thread->stack);
+}
+
+/* 开启栈大小自动调整 */
+int st_stack_autotune(int on) {
+    int wason = _st_autotune_stacks;
+
+    _st_autotune_stacks = on;
+    return wason;
+}
+
 /* 开启随机栈地址机制 */
 int st_randomize_stacks(int on)
 {
@@ -108,3 +844,173 @@ int st_randomize_stacks(int on)
     
     return wason;
 }
+
+/*****************************************
+ * 共享栈(copy-on-switch)。共享栈线程没有自己的栈，而是轮流分配到 ST_SHARED_STACK_COUNT 个共享运行栈
+ * 上执行。某个运行栈上的线程被换出后，栈数据仍然留在运行栈上，直到另一个分配到同一个运行栈的线程要换入
+ * 时，才把前者用到的栈数据 [context.sp, stk_top) 拷贝到其 save_buf 中，再把后者保存的数据拷贝回去
+ * 拷贝操作只能在调度器的栈上进行，所以需要拷贝的切换都会经过调度器，见 _st_vp_switch
+ */
+
+#ifndef ST_SWITCH_UCONTEXT
+
+/* 共享运行栈只能被同一个 vp 上的线程使用，所以以下状态都是每个 vp 一份 */
+static _ST_TLS _st_stack_t *_st_shared_stacks[ST_SHARED_STACK_COUNT];
+static _ST_TLS int _st_shared_stack_next = 0;
+/* 已经退出的共享栈线程对象，用于复用，第一次使用时初始化 */
+static _ST_TLS _st_clist_t _st_free_shared_threads;
+
+/* 统计信息 */
+static _ST_TLS int _st_shared_threads = 0;
+static _ST_TLS long long _st_shared_reserved = 0;   /* 存活线程申请的栈大小之和 */
+static _ST_TLS size_t _st_shared_saved_bytes = 0;
+static _ST_TLS size_t _st_shared_saved_cap = 0;
+static _ST_TLS unsigned long long _st_shared_copies = 0;
+static _ST_TLS unsigned long long _st_shared_copy_bytes = 0;
+
+/* 保存 save_buf 时按这个粒度向上取整，避免频繁 realloc */
+#define _ST_SHARED_SAVE_ALIGN 512
+
+/* 构造一个共享栈线程对象，初始上下文保存在 save_buf 中，第一次换入时拷贝到运行栈上 */
+_st_thread_t *_st_shared_thread_new(int stk_size) {
+    _st_thread_t *thread;
+    _st_stack_t *stack;
+    char frame[256] __attribute__((aligned(16)));
+    char *save_buf;
+    int idx = _st_shared_stack_next;
+
+    /* 延迟创建运行栈 */
+    if (!_st_shared_stacks[idx]) {
+        _st_shared_stacks[idx] = _st_stack_new(ST_SHARED_STACK_SIZE);
+        if (!_st_shared_stacks[idx])
+            return NULL;
+    }
+    stack = _st_shared_stacks[idx];
+
+    if ((save_buf = (char*) malloc(_ST_SHARED_SAVE_ALIGN)) == NULL)
+        return NULL;
+
+    if (_st_free_shared_threads.next == NULL)
+        ST_INIT_CLIST(&_st_free_shared_threads);
+    if (!ST_CLIST_IS_EMPTY(&_st_free_shared_threads)) {
+        thread = _ST_THREAD_PTR(_st_free_shared_threads.next);
+        ST_REMOVE_LINK(&thread->links);
+    } else {
+        if (posix_memalign((void**)&thread, _ST_CACHE_LINE, sizeof(_st_thread_t) + sizeof(void*) * ST_KEYS_MAX) != 0) {
+            free(save_buf);
+            return NULL;
+        }
+    }
+    memset(thread, 0, sizeof(_st_thread_t) + sizeof(void*) * ST_KEYS_MAX);
+    thread->private_data = (void**)(thread + 1);
+    thread->stack = stack;
+    thread->flags = _ST_FL_SHARED_STACK;
+    thread->stk_size = stk_size;
+
+    /* 初始栈帧与位置无关，先构造在临时缓冲区中，再按照运行栈的栈顶换算栈指针 */
+    _ST_MD_INIT(&thread->context, frame, sizeof(frame), _st_thread_main, NULL);
+    thread->save_size = (int)(frame + sizeof(frame) - (char*)thread->context.sp);
+    memcpy(save_buf, thread->context.sp, thread->save_size);
+    thread->save_buf = save_buf;
+    thread->save_cap = _ST_SHARED_SAVE_ALIGN;
+    thread->context.sp = stack->stk_top - thread->save_size;
+
+    _st_shared_stack_next = (idx + 1) % ST_SHARED_STACK_COUNT;
+    _st_shared_threads++;
+    _st_shared_reserved += stk_size;
+    _st_shared_saved_bytes += thread->save_size;
+    _st_shared_saved_cap += thread->save_cap;
+
+    return thread;
+}
+
+/* 线程退出时调用，此时线程仍然运行在运行栈上，不能释放线程对象本身，只是放回 free list 中 */
+void _st_shared_thread_free(_st_thread_t *thread) {
+    /* 运行栈上的数据已经没用了，之后换入的线程不必再拷贝 */
+    if (thread->stack->owner == thread)
+        thread->stack->owner = NULL;
+
+    _st_shared_threads--;
+    _st_shared_reserved -= thread->stk_size;
+    _st_shared_saved_bytes -= thread->save_size;
+    _st_shared_saved_cap -= thread->save_cap;
+    free(thread->save_buf);
+    thread->save_buf = NULL;
+    thread->save_size = thread->save_cap = 0;
+
+    ST_APPEND_LINK(&thread->links, &_st_free_shared_threads);
+}
+
+/* 在调度器的栈上执行，把 thread 换入其运行栈。占用者的栈数据保存不下(内存不足)时返回 -1，运行栈不变 */
+int _st_shared_stack_swap_in(_st_thread_t *thread) {
+    _st_stack_t *stack = thread->stack;
+    _st_thread_t *owner = stack->owner;
+    int size, cap;
+    char *buf;
+
+    if (owner == thread)
+        return 0;
+
+    if (owner) {
+        /* 把占用者用到的栈数据拷贝出去 */
+        size = (int)(stack->stk_top - (char*)owner->context.sp);
+        if (size > owner->save_cap) {
+            cap = (size + _ST_SHARED_SAVE_ALIGN - 1) & ~(_ST_SHARED_SAVE_ALIGN - 1);
+            if ((buf = (char*) realloc(owner->save_buf, cap)) == NULL)
+                return -1;
+            _st_shared_saved_cap += cap - owner->save_cap;
+            owner->save_buf = buf;
+            owner->save_cap = cap;
+        }
+        memcpy(owner->save_buf, owner->context.sp, size);
+        _st_shared_saved_bytes += size - owner->save_size;
+        owner->save_size = size;
+        _st_shared_copy_bytes += size;
+    }
+
+    /* 恢复 thread 的栈数据 */
+    memcpy(stack->stk_top - thread->save_size, thread->save_buf, thread->save_size);
+    _st_shared_copy_bytes += thread->save_size;
+    _st_shared_copies++;
+    stack->owner = thread;
+    return 0;
+}
+
+/* 获取共享栈的统计信息 */
+int st_shared_stack_stats(st_shared_stack_stats_t *stats) {
+    int i, nstacks = 0;
+
+    for (i = 0; i < ST_SHARED_STACK_COUNT; i++) {
+        if (_st_shared_stacks[i])
+            nstacks++;
+    }
+
+    stats->threads = _st_shared_threads;
+    stats->saved_bytes = _st_shared_saved_bytes;
+    stats->mem_saved = _st_shared_reserved - (long long)_st_shared_saved_cap -
+        (long long)nstacks * ST_SHARED_STACK_SIZE;
+    stats->copies = _st_shared_copies;
+    stats->copy_bytes = _st_shared_copy_bytes;
+
+    return 0;
+}
+
+#else
+
+/* ucontext 后端无法得知换出时的栈指针，不支持共享栈，st_thread_create_ex 会退化为独立栈 */
+_st_thread_t *_st_shared_thread_new(int stk_size) {
+    (void) stk_size;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+void _st_shared_thread_free(_st_thread_t *thread) {
+    (void) thread;
+}
+
+int st_shared_stack_stats(st_shared_stack_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+}
+
+#endif
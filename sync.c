@@ -13,35 +13,165 @@
 
 #include "common.h"
 
-extern time_t _st_curr_time;
-extern st_utime_t _st_last_tset;
-extern int _st_active_count;
+extern _ST_TLS time_t _st_curr_time;
+extern _ST_TLS st_utime_t _st_last_tset;
+
+/* 默认时钟，与 state-threads 一致使用 gettimeofday，会受到系统时间调整的影响 */
+static st_utime_t _st_utime_realtime(void) {
+    struct timeval tv;
+    (void) gettimeofday(&tv, NULL);
+    return (tv.tv_sec * 1000000LL + tv.tv_usec);
+}
+
+static st_utime_t _st_utime_monotonic(void) {
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/* 精度是内核的 tick(通常 1ms 到 4ms)，但读取只需要几纳秒 */
+static st_utime_t _st_utime_monotonic_coarse(void) {
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/*
+ * 基于 CPU 计数器的时钟: x86_64 上是 invariant TSC，aarch64 上是 generic timer 的 cntvct_el0
+ * 与 CLOCK_MONOTONIC 对齐基准，之后微秒数 = 基准 + (计数 - 基准计数) * mult >> 32
+ */
+#if defined(__x86_64__) || defined(__aarch64__)
+#define _ST_HAVE_CYCLES
+#endif
+
+#ifndef ST_TSC_CALIBRATE_USECS
+#define ST_TSC_CALIBRATE_USECS 10000
+#endif
+
+#ifdef _ST_HAVE_CYCLES
+static unsigned long long _st_tsc_base;   /* 对齐基准时的计数 */
+static st_utime_t _st_tsc_base_usecs;     /* 对齐基准时 CLOCK_MONOTONIC 的微秒数 */
+static unsigned long long _st_tsc_mult;   /* 每个计数对应的微秒数，32 位定点小数 */
+
+static inline unsigned long long _st_cycles(void) {
+#if defined(__x86_64__)
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long) hi << 32) | lo;
+#else
+    unsigned long long v;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#endif
+}
 
-static st_utime_t (*_st_utime)() = NULL;
+static st_utime_t _st_utime_tsc(void) {
+    return _st_tsc_base_usecs + (st_utime_t)
+        (((unsigned __int128) (_st_cycles() - _st_tsc_base) * _st_tsc_mult) >> 32);
+}
+
+/* 检查计数器是否可用并校准，不可用时返回 -1 */
+static int _st_tsc_calibrate(void) {
+    struct timespec now;
+#if defined(__x86_64__)
+    struct timespec start;
+    unsigned int eax, ebx, ecx, edx;
+    unsigned long long c0, c1, ns;
+
+    /* CPUID.80000007H:EDX[8]，频率恒定且在深度睡眠状态下也不停止的 TSC 才能当作时钟 */
+    __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+    if (eax < 0x80000007)
+        return -1;
+    __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000007));
+    if (!(edx & (1 << 8)))
+        return -1;
+
+    /* TSC 的频率没有可靠的途径获取，对照 CLOCK_MONOTONIC 测量一段时间 */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    c0 = _st_cycles();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = (now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+    } while (ns < ST_TSC_CALIBRATE_USECS * 1000ULL);
+    c1 = _st_cycles();
+    if (c1 <= c0)
+        return -1;
+    _st_tsc_mult = (unsigned long long) (((unsigned __int128) ns << 32) / ((unsigned __int128) (c1 - c0) * 1000));
+#else
+    unsigned long long freq;
+
+    /* generic timer 的频率由固件写在 cntfrq_el0 中 */
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+    if (freq == 0)
+        return -1;
+    _st_tsc_mult = (1000000ULL << 32) / freq;
+#endif
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    _st_tsc_base = _st_cycles();
+    _st_tsc_base_usecs = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+
+    return 0;
+}
+#endif
+
+static st_utime_t (*_st_utime)(void) = _st_utime_realtime;
 
 /* 获取时间，state-thread 提供了定制化这个函数的接口，方便用户可以使用更高效的时间函数 */
 st_utime_t st_utime(void) {
-    if (_st_utime == NULL) {
-        struct timeval tv;
-        (void) gettimeofday(&tv, NULL);
-        return (tv.tv_sec * 1000000LL + tv.tv_usec);
-    }
-    
     return (*_st_utime)();
 }
 
-/* 设置时间获取函数 */
+/* 设置时间获取函数，NULL 恢复默认的时钟 */
 int st_set_utime_function(st_utime_t (*func)(void)) {
     if (_st_active_count) {
         errno = EINVAL;
         return -1;
     }
     
-    _st_utime = func;
+    _st_utime = func ? func : _st_utime_realtime;
     
     return 0;
 }
 
+/* 选择内置的时钟，和 st_set_utime_function 一样只能在没有活跃线程时设置 */
+int st_set_clock_source(int source) {
+    st_utime_t (*func)(void);
+
+    if (_st_active_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (source) {
+    case ST_CLOCK_REALTIME:
+        func = _st_utime_realtime;
+        break;
+    case ST_CLOCK_MONOTONIC:
+        func = _st_utime_monotonic;
+        break;
+    case ST_CLOCK_MONOTONIC_COARSE:
+        func = _st_utime_monotonic_coarse;
+        break;
+#ifdef _ST_HAVE_CYCLES
+    case ST_CLOCK_TSC:
+        if (_st_tsc_calibrate() < 0) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        func = _st_utime_tsc;
+        break;
+#endif
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    _st_utime = func;
+
+    return 0;
+}
+
 st_utime_t st_utime_last_clock(void) {
     return _ST_LAST_CLOCK;
 }
@@ -180,6 +310,7 @@ int st_cond_timedwait(_st_cond_t *cvar, st_utime_t timeout) {
 
     if (me->flags & _ST_FL_TIMEDOUT) {
         /* 返回是因为超时 */
+        me->flags &= ~_ST_FL_TIMEDOUT;
         errno = ETIME;
         rv = -1;
     }
@@ -200,18 +331,24 @@ static int _st_cond_signal(_st_cond_t *cvar, int broadcast) {
     /* 遍历所有的等待线程 */
     for (q = cvar->wait_q.next; q != &cvar->wait_q; q = q->next) {
         thread = _ST_THREAD_WAITQ_PTR(q);
-        if (thread->state == _ST_ST_COND_WAIT) {
-            /* 如果线程处于等待条件变量的状态，从等待队列删除(我实在没想到为什么会不是这个状态) */
+        if (thread->state != _ST_ST_COND_WAIT) {
+            /* 已经被通知过(或者超时)但还没有运行的线程仍在等待队列中，它恢复执行时才会把自己移除 */
+            continue;
+        }
+
+        /* 只有带超时的等待才会在休眠队列中 */
+        if (thread->flags & _ST_FL_ON_SLEEPQ) {
             _ST_DEL_SLEEPQ(thread);
         }
 
-        /* 线程重新变为可执行 */
+        /* 线程重新变为可执行，signal 唤醒的线程紧接着当前线程运行 */
         thread->state = _ST_ST_RUNNABLE;
-        _ST_ADD_RUNQ(thread);
         if (!broadcast) {
+            _ST_ADD_RUNNEXT(thread);
             /* 如果不是广播，通知第一个线程以后就退出 */
             break;
         }
+        _ST_ADD_RUNQ(thread);
     }
 
     return 0;
@@ -312,7 +449,7 @@ int st_mutex_unlock(_st_mutex_t *lock) {
             /* 如果是在等待锁，将锁的所有权给第一个 thread */
             lock->owner = thread;
             thread->state = _ST_ST_RUNNABLE;
-            _ST_ADD_RUNQ(thread);
+            _ST_ADD_RUNNEXT(thread);
             return 0;
         }
     }
@@ -0,0 +1,135 @@
+/*
+ * 回归测试: 共享栈线程阻塞在 IO 上。等待节点、pollfd 与 IO 缓冲区都不能在线程换出后留在运行栈上，
+ * 否则会被下一个换入的线程覆盖
+ *
+ * 8 个共享栈线程(共用同一批运行栈)分别从 pipe 与 socketpair 中读取，每一轮都会阻塞，醒来后检查读到的
+ * 数据和栈上的局部变量，最后用 st_poll 同时等待两个描述符。参数选择事件系统: epoll(默认)、et(边沿触发)、
+ * uring
+ *
+ *   cd test && gcc -O2 -I.. ../[a-z]*.c ../md.S shared_stack_io.c -o shared_stack_io -lpthread
+ *   ./shared_stack_io && ./shared_stack_io et && ./shared_stack_io uring
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "public.h"
+
+#define NREADERS 8
+#define ROUNDS   2000
+
+static st_netfd_t rfds[NREADERS], wfds[NREADERS];
+static st_netfd_t idle_rfd;
+static int done = 0;
+
+static void fail(const char *msg, int id)
+{
+    fprintf(stderr, "FAIL: %s (reader %d)\n", msg, id);
+    exit(1);
+}
+
+static void *reader(void *arg)
+{
+    int id = (int) (long) arg;
+    int canary = id * 7919 + 1;
+    int msg[2];
+    char byte;
+    struct pollfd pds[2];
+    int r;
+
+    for (r = 0; r < ROUNDS; r++) {
+        if (st_read(rfds[id], msg, sizeof(msg), ST_UTIME_NO_TIMEOUT) != (ssize_t) sizeof(msg))
+            fail("short read", id);
+        if (msg[0] != id || msg[1] != r)
+            fail("wrong data", id);
+        if (canary != id * 7919 + 1)
+            fail("stack clobbered", id);
+    }
+
+    /* pds 在共享栈上，等待期间事件系统不能直接写它 */
+    pds[0].fd = st_netfd_fileno(idle_rfd);
+    pds[0].events = POLLIN;
+    pds[0].revents = 0;
+    pds[1].fd = st_netfd_fileno(rfds[id]);
+    pds[1].events = POLLIN;
+    pds[1].revents = 0;
+    if (st_poll(pds, 2, ST_UTIME_NO_TIMEOUT) != 1 || pds[0].revents || !(pds[1].revents & POLLIN))
+        fail("st_poll", id);
+    if (st_read(rfds[id], &byte, 1, ST_UTIME_NO_TIMEOUT) != 1 || byte != (char) id)
+        fail("last byte", id);
+    if (canary != id * 7919 + 1)
+        fail("stack clobbered", id);
+
+    done++;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = argc > 1 ? argv[1] : "epoll";
+    int fds[2], msg[2], i, r;
+    char byte;
+
+    if (strcmp(mode, "uring") == 0 && st_set_eventsys(ST_EVENTSYS_IO_URING) < 0) {
+        printf("skip: io_uring not available\n");
+        return 0;
+    }
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+    if (strcmp(mode, "et") == 0)
+        st_edge_triggered(1);
+    /* 挂住时直接失败 */
+    alarm(30);
+
+    if (pipe(fds) < 0 || !(idle_rfd = st_netfd_open(fds[0])))
+        fail("pipe", -1);
+
+    for (i = 0; i < NREADERS; i++) {
+        /* 一半用 pipe，一半用 socket(边沿触发只作用于 socket) */
+        if (i % 2) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+                fail("socketpair", i);
+            rfds[i] = st_netfd_open_socket(fds[0]);
+            wfds[i] = st_netfd_open_socket(fds[1]);
+        } else {
+            if (pipe(fds) < 0)
+                fail("pipe", i);
+            rfds[i] = st_netfd_open(fds[0]);
+            wfds[i] = st_netfd_open(fds[1]);
+        }
+        if (!rfds[i] || !wfds[i])
+            fail("st_netfd_open", i);
+        if (!st_thread_create_ex(reader, (void*) (long) i, 0, 0, ST_THREAD_SHARED_STACK))
+            fail("st_thread_create_ex", i);
+    }
+
+    for (r = 0; r < ROUNDS; r++) {
+        /* 先让所有读者阻塞，再逐个唤醒 */
+        st_usleep(0);
+        for (i = 0; i < NREADERS; i++) {
+            msg[0] = i;
+            msg[1] = r;
+            if (st_write(wfds[i], msg, sizeof(msg), ST_UTIME_NO_TIMEOUT) != (ssize_t) sizeof(msg))
+                fail("write", i);
+        }
+    }
+    st_usleep(0);
+    for (i = 0; i < NREADERS; i++) {
+        byte = (char) i;
+        if (st_write(wfds[i], &byte, 1, ST_UTIME_NO_TIMEOUT) != 1)
+            fail("write", i);
+    }
+
+    while (done < NREADERS)
+        st_usleep(1000);
+
+    printf("ok: %s\n", mode);
+    return 0;
+}
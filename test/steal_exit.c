@@ -0,0 +1,88 @@
+/*
+ * 回归测试: vp 0 上创建的线程被其他 vp 窃取走以后，vp 0 的线程都结束了也要等它们运行完才能退出进程
+ *
+ * 原始线程创建一批可窃取的线程后直接 st_thread_exit，3 个额外的 vp 空闲时会窃取其中一部分。进程退出时
+ * 检查所有线程都运行完了
+ *
+ *   cd test && gcc -O2 -I.. ../[a-z]*.c ../md.S steal_exit.c -o steal_exit -lpthread
+ *   ./steal_exit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "public.h"
+
+#define NTHREADS 200
+
+static long finished = 0;
+
+static void spin(void)
+{
+    volatile long x = 0;
+    int i;
+
+    for (i = 0; i < 300000; i++)
+        x += i;
+}
+
+static void *work(void *arg)
+{
+    (void) arg;
+    spin();
+    st_usleep(2000);
+    spin();
+    __atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* 额外的 vp 上只有这一个线程，结束后 vp 空闲，去窃取 vp 0 的线程 */
+static void *vp_main(void *arg)
+{
+    (void) arg;
+    st_usleep(300000);
+    return NULL;
+}
+
+static void check(void)
+{
+    long n = __atomic_load_n(&finished, __ATOMIC_RELAXED);
+
+    if (n != NTHREADS) {
+        fprintf(stderr, "FAIL: %ld of %d threads finished\n", n, NTHREADS);
+        _exit(1);
+    }
+    printf("ok\n");
+}
+
+int main(void)
+{
+    int i;
+
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+    st_work_stealing(1);
+    atexit(check);
+    alarm(30);
+
+    if (st_vp_start(3, vp_main, NULL) != 3) {
+        perror("st_vp_start");
+        return 1;
+    }
+    /* 等 vp 启动 */
+    usleep(20000);
+
+    for (i = 0; i < NTHREADS; i++) {
+        if (!st_thread_create(work, NULL, 0, 0)) {
+            perror("st_thread_create");
+            return 1;
+        }
+    }
+
+    /* 所有线程结束后调度器调用 exit */
+    st_thread_exit(NULL);
+    return 0;
+}
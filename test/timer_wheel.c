@@ -0,0 +1,80 @@
+/*
+ * 时间轮的正确性: 在可控的假时钟下放入 100000 个 IO 超时(一部分短于 ST_TIMER_WHEEL_MIN 进入休眠堆，
+ * 其余覆盖时间轮的各层以及超出最高层的范围)，随机地推进时钟，检查每个超时都不会提前触发，
+ * 并且最多晚一个 tick
+ *
+ *   cd test && gcc -O2 -I.. ../[a-z]*.c ../md.S timer_wheel.c -o timer_wheel -lpthread && ./timer_wheel
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define NTIMERS 100000
+
+static st_utime_t fake_now = 1000000000ULL;
+
+static st_utime_t fake_clock(void)
+{
+    return fake_now;
+}
+
+int main(void)
+{
+    _st_thread_t *threads, *thread;
+    st_utime_t timeout, prev;
+    int fired = 0, bad = 0, i;
+
+    st_set_utime_function(fake_clock);
+    if (st_init() < 0) {
+        perror("st_init");
+        return 1;
+    }
+    threads = (_st_thread_t*) aligned_alloc(_ST_CACHE_LINE, sizeof(_st_thread_t) * NTIMERS);
+    if (!threads) {
+        perror("malloc");
+        return 1;
+    }
+    memset(threads, 0, sizeof(_st_thread_t) * NTIMERS);
+
+    srandom(2);
+    for (i = 0; i < NTIMERS; i++) {
+        if (i % 10 == 0)
+            /* 0~100s，整毫秒 */
+            timeout = (st_utime_t) (random() % 100000) * 1000;
+        else
+            /* 10ms 起，最长 50 分钟，超出时间轮的范围 */
+            timeout = 10000 + random() % (i % 3 ? 3000000000ULL : 100000000ULL);
+        threads[i].state = _ST_ST_IO_WAIT;
+        _st_add_io_timeout(&threads[i], timeout);
+    }
+
+    prev = fake_now;
+    while (fired < NTIMERS) {
+        fake_now += 1 + random() % (random() % 2 ? 2000 : 50000000);
+        _st_vp_check_clock();
+        while (!ST_CLIST_IS_EMPTY(&_ST_RUNQ)) {
+            thread = _ST_THREAD_PTR(_ST_RUNQ.next);
+            _ST_DEL_RUNQ(thread);
+            fired++;
+            if (thread->due > fake_now) {
+                if (++bad < 5)
+                    printf("early: due %llu now %llu\n", thread->due, fake_now);
+            } else if (thread->due + ST_TIMER_WHEEL_TICK <= prev) {
+                /* 上一次检查时已经过期超过一个 tick 却没有触发 */
+                if (++bad < 5)
+                    printf("late: due %llu previous check %llu\n", thread->due, prev);
+            }
+        }
+        prev = fake_now;
+    }
+
+    if (bad) {
+        printf("FAIL: %d of %d timeouts fired early or late\n", bad, fired);
+        return 1;
+    }
+    printf("ok: %d timeouts\n", fired);
+    return 0;
+}
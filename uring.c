@@ -0,0 +1,744 @@
+/*
+ * io_uring 事件系统，通过 st_set_eventsys(ST_EVENTSYS_IO_URING) 在 st_init 之前选择
+ * 就绪通知(st_poll)用一次性的 IORING_OP_POLL_ADD 实现，st_read、st_write、st_accept、st_connect 则把
+ * 操作本身交给内核，线程挂起直到操作完成，不再需要先试一次系统调用、EAGAIN 之后等待就绪再重试
+ * 提交只是写入与内核共享的提交队列，由 dispatch 在一次 io_uring_enter 中批量提交并收取完成事件，
+ * 每一轮调度只有这一次系统调用。没有依赖 liburing，直接调用系统调用并操作映射进来的环形队列
+ *
+ * 内核可能在请求提交之后的任意时刻访问 user_data 指向的对象，所以请求对象由事件系统自己分配，
+ * 不能放在线程栈上。st_poll 返回时取消掉的 poll 请求变为孤儿，等它的完成事件到达后再回收；
+ * IO 请求则一定等到完成事件到达才返回，因为之前内核随时可能读写用户的 buf
+ */
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#ifdef _ST_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+#ifndef ST_URING_ENTRIES
+    /* 提交队列的长度，完成队列是它的两倍，提交队列满时提前提交 */
+    #define ST_URING_ENTRIES 1024
+#endif
+
+/* 请求类型 */
+#define _ST_URING_POLL 0
+#define _ST_URING_IO   1
+
+/* 提交给内核的请求，sqe 的 user_data 指向它。不关心结果的请求(取消、超时)的 user_data 为 0 */
+typedef struct _st_uring_req {
+    _st_clist_t links;            /* 所有未完成的请求，fork 后用来清理 */
+    struct _st_uring_req *next;   /* 空闲链表 */
+    int type;
+    _st_pollq_t *pq;              /* poll: 所属的 pollq，被取消后为 NULL */
+    int idx;                      /* poll: 在 pollq 中的下标 */
+    _st_thread_t *thread;         /* IO: 等待完成的线程 */
+    int res;                      /* IO: 完成的结果 */
+    int done;                     /* IO: 是否已经完成 */
+    struct __kernel_timespec ts;  /* IO: 超时，提交时内核才读取，需要保持有效 */
+} _st_uring_req_t;
+
+static _ST_TLS struct _st_uringdata {
+    int ring_fd;
+    unsigned int setup_flags;          /* io_uring_setup 实际使用的 flags */
+
+    /* 提交队列 */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;        /* 已经写入、还没有发布给内核的位置 */
+    struct io_uring_sqe *sqes;
+
+    /* 完成队列 */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    _st_clist_t reqs;                  /* 未完成的请求 */
+    _st_uring_req_t *free_reqs;        /* 请求对象的空闲链表 */
+    int *fd_refs;                      /* 每个描述符上等待的 poll 与 IO 个数，有引用时不能关闭 */
+    int fd_refs_size;
+    pid_t pid;                         /* 进程 id */
+} *_st_uring_data;
+
+static int _st_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _st_uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                           void *arg, size_t argsz)
+{
+    return (int) syscall(__NR_io_uring_enter, _st_uring_data->ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/* 内核是否可用并且支持需要的特性，st_set_eventsys 选择 io_uring 时调用 */
+int _st_uring_probe(void)
+{
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = _st_uring_setup(4, &p)) < 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    close(fd);
+
+    /* 带超时的等待(5.11)，完成队列满时不丢弃事件，以及不需要内核线程的 poll 驱动 IO */
+    if ((p.features & (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL)) !=
+        (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 解除映射并关闭 ring */
+static void _st_uring_ring_close(void)
+{
+    if (_st_uring_data->sqes)
+        munmap(_st_uring_data->sqes, _st_uring_data->sqes_size);
+    if (_st_uring_data->cq_ring && _st_uring_data->cq_ring != _st_uring_data->sq_ring)
+        munmap(_st_uring_data->cq_ring, _st_uring_data->cq_ring_size);
+    if (_st_uring_data->sq_ring)
+        munmap(_st_uring_data->sq_ring, _st_uring_data->sq_ring_size);
+    if (_st_uring_data->ring_fd >= 0)
+        close(_st_uring_data->ring_fd);
+    _st_uring_data->sqes = NULL;
+    _st_uring_data->sq_ring = NULL;
+    _st_uring_data->cq_ring = NULL;
+    _st_uring_data->ring_fd = -1;
+}
+
+/* 创建 ring 并映射提交、完成队列 */
+static int _st_uring_ring_open(void)
+{
+    struct _st_uringdata *d = _st_uring_data;
+    struct io_uring_params p;
+    unsigned int *array;
+    unsigned int i;
+    char *sq, *cq;
+
+    /*
+     * 只有所属的 vp 会提交请求，DEFER_TASKRUN 让内核把完成工作推迟到我们调用 io_uring_enter 收取时再做，
+     * 而不是在任意时刻打断这个 OS 线程。老内核不支持时不带 flags 重试
+     */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((d->ring_fd = _st_uring_setup(ST_URING_ENTRIES, &p)) < 0) {
+        memset(&p, 0, sizeof(p));
+        if ((d->ring_fd = _st_uring_setup(ST_URING_ENTRIES, &p)) < 0)
+            return -1;
+    }
+    d->setup_flags = p.flags;
+
+    d->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    d->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        /* 提交队列与完成队列在同一个映射中 */
+        if (d->cq_ring_size > d->sq_ring_size)
+            d->sq_ring_size = d->cq_ring_size;
+        d->cq_ring_size = d->sq_ring_size;
+    }
+
+    d->sq_ring = mmap(NULL, d->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      d->ring_fd, IORING_OFF_SQ_RING);
+    if (d->sq_ring == MAP_FAILED) {
+        d->sq_ring = NULL;
+        goto failed;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        d->cq_ring = d->sq_ring;
+    } else {
+        d->cq_ring = mmap(NULL, d->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          d->ring_fd, IORING_OFF_CQ_RING);
+        if (d->cq_ring == MAP_FAILED) {
+            d->cq_ring = NULL;
+            goto failed;
+        }
+    }
+    d->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    d->sqes = mmap(NULL, d->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   d->ring_fd, IORING_OFF_SQES);
+    if (d->sqes == MAP_FAILED) {
+        d->sqes = NULL;
+        goto failed;
+    }
+
+    sq = (char *) d->sq_ring;
+    cq = (char *) d->cq_ring;
+    d->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    d->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    d->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+    d->sq_entries = p.sq_entries;
+    d->sq_local_tail = *d->sq_tail;
+    d->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    d->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    d->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+    d->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* 提交队列的下标数组固定为一一对应，之后只需要推进 tail */
+    array = (unsigned int *) (sq + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    d->pid = getpid();
+    return 0;
+
+ failed:
+    i = errno;
+    _st_uring_ring_close();
+    errno = i;
+    return -1;
+}
+
+/* 初始化 */
+static int _st_uring_init(void)
+{
+    _st_uring_data = (struct _st_uringdata *) calloc(1, sizeof(*_st_uring_data));
+    if (!_st_uring_data)
+        return -1;
+    _st_uring_data->ring_fd = -1;
+    ST_INIT_CLIST(&_st_uring_data->reqs);
+
+    if (_st_uring_ring_open() < 0) {
+        int err = errno;
+        free(_st_uring_data);
+        _st_uring_data = NULL;
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 分配请求对象，按批从堆上申请，不再释放 */
+static _st_uring_req_t *_st_uring_req_alloc(int type)
+{
+    _st_uring_req_t *req;
+    int i;
+
+    if (!_st_uring_data->free_reqs) {
+        req = (_st_uring_req_t *) calloc(64, sizeof(_st_uring_req_t));
+        if (!req)
+            return NULL;
+        for (i = 0; i < 64; i++) {
+            req[i].next = _st_uring_data->free_reqs;
+            _st_uring_data->free_reqs = &req[i];
+        }
+    }
+
+    req = _st_uring_data->free_reqs;
+    _st_uring_data->free_reqs = req->next;
+    req->type = type;
+    req->pq = NULL;
+    req->thread = NULL;
+    req->done = 0;
+    ST_APPEND_LINK(&req->links, &_st_uring_data->reqs);
+    return req;
+}
+
+static void _st_uring_req_free(_st_uring_req_t *req)
+{
+    ST_REMOVE_LINK(&req->links);
+    req->next = _st_uring_data->free_reqs;
+    _st_uring_data->free_reqs = req;
+}
+
+/* 把已经写入的提交发布给内核，返回待提交的个数 */
+static unsigned int _st_uring_flush(void)
+{
+    __atomic_store_n(_st_uring_data->sq_tail, _st_uring_data->sq_local_tail, __ATOMIC_RELEASE);
+    return _st_uring_data->sq_local_tail - __atomic_load_n(_st_uring_data->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* 在提交队列中预留 n 个连续的位置，队列满时先提交一次 */
+static int _st_uring_reserve(unsigned int n)
+{
+    unsigned int head = __atomic_load_n(_st_uring_data->sq_head, __ATOMIC_ACQUIRE);
+
+    if (_st_uring_data->sq_local_tail - head + n <= _st_uring_data->sq_entries)
+        return 0;
+
+    if (_st_uring_enter(_st_uring_flush(), 0, 0, NULL, 0) < 0 && errno != EBUSY && errno != EAGAIN)
+        return -1;
+
+    head = __atomic_load_n(_st_uring_data->sq_head, __ATOMIC_ACQUIRE);
+    if (_st_uring_data->sq_local_tail - head + n <= _st_uring_data->sq_entries)
+        return 0;
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/* 取一个提交位置，调用前需要用 _st_uring_reserve 预留 */
+static struct io_uring_sqe *_st_uring_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = &_st_uring_data->sqes[_st_uring_data->sq_local_tail & _st_uring_data->sq_mask];
+    _st_uring_data->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* 描述符引用计数 */
+static int _st_uring_fd_expand(int maxfd)
+{
+    int *ptr;
+    int n = _st_uring_data->fd_refs_size ? _st_uring_data->fd_refs_size : 1024;
+
+    while (maxfd >= n)
+        n <<= 1;
+
+    ptr = (int *) realloc(_st_uring_data->fd_refs, n * sizeof(int));
+    if (!ptr)
+        return -1;
+
+    memset(ptr + _st_uring_data->fd_refs_size, 0, (n - _st_uring_data->fd_refs_size) * sizeof(int));
+    _st_uring_data->fd_refs = ptr;
+    _st_uring_data->fd_refs_size = n;
+
+    return 0;
+}
+
+/* 为 pollq 中的每个描述符提交一个一次性的 poll 请求 */
+static int _st_uring_poll_submit(_st_pollq_t *pq)
+{
+    struct io_uring_sqe *sqe;
+    _st_uring_req_t *req;
+    int i;
+
+    for (i = 0; i < pq->npds; i++) {
+        if (_st_uring_reserve(1) < 0 || !(req = _st_uring_req_alloc(_ST_URING_POLL)))
+            return -1;
+        req->pq = pq;
+        req->idx = i;
+        pq->waits[i].data = req;
+
+        sqe = _st_uring_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = pq->pds[i].fd;
+        sqe->poll32_events = (unsigned short) pq->pds[i].events;
+        sqe->user_data = (uint64_t) (uintptr_t) req;
+    }
+
+    return 0;
+}
+
+/* 取消 pollq 中还没有完成的 poll 请求，它们变为孤儿，在完成事件到达时回收 */
+static void _st_uring_poll_cancel(_st_pollq_t *pq)
+{
+    struct io_uring_sqe *sqe;
+    _st_uring_req_t *req;
+    int i;
+
+    for (i = 0; i < pq->npds; i++) {
+        if (!(req = pq->waits[i].data))
+            continue;
+        pq->waits[i].data = NULL;
+        req->pq = NULL;
+        if (_st_uring_reserve(1) < 0)
+            continue;
+        sqe = _st_uring_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) (uintptr_t) req;
+    }
+}
+
+static void _st_uring_pollset_del(_st_pollq_t *pq)
+{
+    int i;
+
+    _st_uring_poll_cancel(pq);
+    for (i = 0; i < pq->npds; i++)
+        _st_uring_data->fd_refs[pq->pds[i].fd]--;
+}
+
+static int _st_uring_pollset_add(_st_pollq_t *pq)
+{
+    int i, fd;
+
+    /* 添加前，对输入进行尽可能多的校验 */
+    for (i = 0; i < pq->npds; i++) {
+        fd = pq->pds[i].fd;
+        if (fd < 0 || !pq->pds[i].events ||
+            (pq->pds[i].events & ~(POLLIN | POLLOUT | POLLPRI))) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (fd >= _st_uring_data->fd_refs_size && _st_uring_fd_expand(fd) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < pq->npds; i++)
+        pq->waits[i].data = NULL;
+    if (_st_uring_poll_submit(pq) < 0) {
+        int err = errno;
+        _st_uring_poll_cancel(pq);
+        errno = err;
+        return -1;
+    }
+
+    for (i = 0; i < pq->npds; i++)
+        _st_uring_data->fd_refs[pq->pds[i].fd]++;
+
+    return 0;
+}
+
+/*
+ * 可能调用了 fork，子进程与父进程共享同一个 ring，重新创建一个。父进程提交的请求在子进程中
+ * 不会再有完成事件: poll 请求按 IOQ 重新提交，IO 请求以 EAGAIN 结束，由调用者按就绪通知的方式重试
+ */
+static int _st_uring_check_fork(void)
+{
+    _st_clist_t *q;
+    _st_uring_req_t *req;
+    _st_pollq_t *pq;
+
+    if (_st_uring_data->pid == getpid())
+        return 0;
+
+    _st_uring_ring_close();
+    if (_st_uring_ring_open() < 0)
+        return -1;
+
+    while ((q = _st_uring_data->reqs.next) != &_st_uring_data->reqs) {
+        req = (_st_uring_req_t *) ((char *) q - offsetof(_st_uring_req_t, links));
+        if (req->type == _ST_URING_IO) {
+            ST_REMOVE_LINK(&req->links);
+            ST_INIT_CLIST(&req->links);
+            req->res = -EAGAIN;
+            req->done = 1;
+            if (req->thread->state == _ST_ST_IO_WAIT) {
+                req->thread->state = _ST_ST_RUNNABLE;
+                _ST_ADD_RUNQ(req->thread);
+            }
+        } else {
+            if (req->pq)
+                req->pq->waits[req->idx].data = NULL;
+            _st_uring_req_free(req);
+        }
+    }
+
+    for (q = _ST_IOQ.next; q != &_ST_IOQ; q = q->next) {
+        pq = _ST_POLLQUEUE_PTR(q);
+        _st_uring_poll_submit(pq);
+    }
+
+    return 0;
+}
+
+/* 处理一个完成事件，被唤醒的 pollq 放到 woken 中，由调用者在收取完之后取消它们其余的 poll 请求 */
+static void _st_uring_complete(struct io_uring_cqe *cqe, _st_clist_t *woken)
+{
+    _st_uring_req_t *req = (_st_uring_req_t *) (uintptr_t) cqe->user_data;
+    _st_pollq_t *pq;
+    struct pollfd *pd;
+    int i;
+
+    if (!req)
+        return;
+
+    if (req->type == _ST_URING_IO) {
+        req->res = cqe->res;
+        req->done = 1;
+        /* 线程可能已经被打断，处于可运行状态 */
+        if (req->thread->state == _ST_ST_IO_WAIT) {
+            req->thread->state = _ST_ST_RUNNABLE;
+            _ST_ADD_RUNQ(req->thread);
+        }
+        return;
+    }
+
+    pq = req->pq;
+    if (pq) {
+        pq->waits[req->idx].data = NULL;
+        pd = &pq->pds[req->idx];
+        if (pq->on_ioq) {
+            /* pollq 中第一个就绪的描述符，唤醒线程 */
+            for (i = 0; i < pq->npds; i++)
+                pq->pds[i].revents = 0;
+            ST_REMOVE_LINK(&pq->links);
+            pq->on_ioq = 0;
+            ST_APPEND_LINK(&pq->links, woken);
+
+            if (pq->thread->flags & _ST_FL_ON_SLEEPQ)
+                _ST_DEL_SLEEPQ(pq->thread);
+            pq->thread->state = _ST_ST_RUNNABLE;
+            _ST_ADD_RUNQ(pq->thread);
+        }
+        if (cqe->res < 0)
+            pd->revents = (cqe->res == -EBADF) ? POLLNVAL : POLLERR;
+        else
+            pd->revents = (short) (cqe->res & (pd->events | POLLERR | POLLHUP | POLLNVAL));
+    }
+    _st_uring_req_free(req);
+}
+
+/* 收取所有完成事件 */
+static void _st_uring_reap(void)
+{
+    unsigned int head, tail;
+    _st_clist_t woken, *q;
+    _st_pollq_t *pq;
+
+    ST_INIT_CLIST(&woken);
+    head = *_st_uring_data->cq_head;
+    tail = __atomic_load_n(_st_uring_data->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        _st_uring_complete(&_st_uring_data->cqes[head & _st_uring_data->cq_mask], &woken);
+        head++;
+    }
+    __atomic_store_n(_st_uring_data->cq_head, head, __ATOMIC_RELEASE);
+
+    while ((q = woken.next) != &woken) {
+        pq = _ST_POLLQUEUE_PTR(q);
+        ST_REMOVE_LINK(q);
+        _st_uring_pollset_del(pq);
+    }
+}
+
+/*
+ * 与 epoll 一样，block 为 1 时等待到下一个超时时间，为 0 时只收集已经完成的事件。
+ * 提交与等待在同一次 io_uring_enter 中完成
+ */
+static void _st_uring_dispatch(int block)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    st_utime_t timeout, now;
+    unsigned int to_submit, min_complete, flags;
+
+    if (_st_uring_check_fork() < 0)
+        return;
+
+    timeout = block ? _st_sleep_next_due() : 0;
+    if (timeout != ST_UTIME_NO_TIMEOUT && timeout != 0) {
+        now = st_utime();
+        timeout = (timeout <= now) ? 0 : (timeout - now);
+    }
+
+    if (((_st_work_stealing && _st_steal_nrings > 1) || _ST_VP_LENT()) && timeout > ST_STEAL_POLL_MSECS * 1000) {
+        /* 其他 vp 可能产生新的可窃取线程，或者正在结束从这里窃取的线程，不能无限期地阻塞 */
+        timeout = ST_STEAL_POLL_MSECS * 1000;
+    }
+
+    if (*_st_uring_data->cq_head != __atomic_load_n(_st_uring_data->cq_tail, __ATOMIC_ACQUIRE)) {
+        /* 已经有完成事件了，不需要等待 */
+        timeout = 0;
+    }
+
+    to_submit = _st_uring_flush();
+    min_complete = 0;
+    flags = IORING_ENTER_GETEVENTS;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout != 0) {
+        min_complete = 1;
+        if (timeout != ST_UTIME_NO_TIMEOUT) {
+            ts.tv_sec = timeout / 1000000LL;
+            ts.tv_nsec = (timeout % 1000000LL) * 1000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+
+    /*
+     * 没有 DEFER_TASKRUN 时完成事件由内核直接写入完成队列，没有要提交也不需要等待时可以省掉这次系统调用。
+     * 超时(ETIME)、信号(EINTR)以及完成队列溢出(EBUSY)时都直接去收取
+     */
+    if (to_submit || min_complete || (_st_uring_data->setup_flags & IORING_SETUP_DEFER_TASKRUN)) {
+        if (flags & IORING_ENTER_EXT_ARG)
+            (void) _st_uring_enter(to_submit, min_complete, flags, &arg, sizeof(arg));
+        else
+            (void) _st_uring_enter(to_submit, min_complete, flags, NULL, _NSIG / 8);
+    }
+
+    _st_uring_reap();
+}
+
+/*
+ * 由内核完成一次 IO 操作。有超时时在后面链接一个 IORING_OP_LINK_TIMEOUT，超时后内核取消这个操作，
+ * 操作要么完成要么被取消，不会出现超时返回了数据却已经被读走的情况
+ */
+static ssize_t _st_uring_io(int op, int osfd, void *buf, size_t len, void *arg, st_utime_t timeout)
+{
+    _st_thread_t *me = _ST_CURRENT_THREAD();
+    struct io_uring_sqe *sqe;
+    _st_uring_req_t *req;
+    int cancelled = 0;
+    int res;
+
+    if (me->flags & _ST_FL_INTERRUPT) {
+        me->flags &= ~_ST_FL_INTERRUPT;
+        errno = EINTR;
+        return -1;
+    }
+
+    if (me->flags & _ST_FL_SHARED_STACK) {
+        /* 共享栈线程的 buf 可能在运行栈上，换出后内核不能再写入，走就绪通知，由线程自己读写 */
+        errno = EAGAIN;
+        return -1;
+    }
+    if (_st_uring_data->pid != getpid() || osfd < 0) {
+        /* fork 之后还没有重新创建 ring，先走就绪通知 */
+        errno = EAGAIN;
+        return -1;
+    }
+    if (osfd >= _st_uring_data->fd_refs_size && _st_uring_fd_expand(osfd) < 0)
+        return -1;
+    if (_st_uring_reserve(timeout == ST_UTIME_NO_TIMEOUT ? 1 : 2) < 0 ||
+        !(req = _st_uring_req_alloc(_ST_URING_IO))) {
+        errno = EAGAIN;
+        return -1;
+    }
+    req->thread = me;
+
+    sqe = _st_uring_sqe();
+    sqe->fd = osfd;
+    sqe->user_data = (uint64_t) (uintptr_t) req;
+    switch (op) {
+    case _ST_IO_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uint64_t) (uintptr_t) buf;
+        sqe->len = (unsigned int) len;
+        sqe->off = (uint64_t) -1;
+        break;
+    case _ST_IO_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uint64_t) (uintptr_t) buf;
+        sqe->len = (unsigned int) len;
+        sqe->off = (uint64_t) -1;
+        break;
+    case _ST_IO_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->addr = (uint64_t) (uintptr_t) buf;
+        sqe->addr2 = (uint64_t) (uintptr_t) arg;
+        break;
+    default:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = (uint64_t) (uintptr_t) buf;
+        sqe->off = len;
+        break;
+    }
+
+    if (timeout != ST_UTIME_NO_TIMEOUT) {
+        sqe->flags |= IOSQE_IO_LINK;
+        req->ts.tv_sec = timeout / 1000000LL;
+        req->ts.tv_nsec = (timeout % 1000000LL) * 1000;
+        sqe = _st_uring_sqe();
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) (uintptr_t) &req->ts;
+        sqe->len = 1;
+    }
+
+    _st_uring_data->fd_refs[osfd]++;
+    me->state = _ST_ST_IO_WAIT;
+    _ST_SWITCH_CONTEXT(me);
+
+    while (!req->done) {
+        /* 被打断了，取消操作，但还是要等到它真正结束，之前内核仍可能访问 buf */
+        if (!cancelled && _st_uring_reserve(1) == 0) {
+            sqe = _st_uring_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t) (uintptr_t) req;
+            cancelled = 1;
+        }
+        me->state = _ST_ST_IO_WAIT;
+        _ST_SWITCH_CONTEXT(me);
+    }
+
+    _st_uring_data->fd_refs[osfd]--;
+    res = req->res;
+    _st_uring_req_free(req);
+
+    if (res >= 0) {
+        /* 操作已经完成，即使被打断也返回结果，打断留给下一次阻塞调用 */
+        return res;
+    }
+    if (me->flags & _ST_FL_INTERRUPT) {
+        me->flags &= ~_ST_FL_INTERRUPT;
+        errno = EINTR;
+    } else {
+        /* 被 LINK_TIMEOUT 取消 */
+        errno = (res == -ECANCELED) ? ETIME : -res;
+    }
+    return -1;
+}
+
+static int _st_uring_fd_new(int osfd)
+{
+    if (osfd >= _st_uring_data->fd_refs_size && _st_uring_fd_expand(osfd) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int _st_uring_fd_close(int osfd)
+{
+    /* 如果仍有线程在等待，则返回错误 */
+    if (osfd < _st_uring_data->fd_refs_size && _st_uring_data->fd_refs[osfd]) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _st_uring_fd_getlimit(void)
+{
+    /* 0 代表没有限制 */
+    return 0;
+}
+
+/* 读写本来就不需要注册，边沿触发没有意义，netfd 保持每次等待时提交 poll */
+static int _st_uring_netfd_add(struct _st_netfd *fd)
+{
+    (void) fd;
+    errno = ENOTSUP;
+    return -1;
+}
+
+static void _st_uring_netfd_del(struct _st_netfd *fd)
+{
+    (void) fd;
+}
+
+_st_eventsys_t _st_uring_eventsys = {
+    "io_uring",
+    _st_uring_init,
+    _st_uring_dispatch,
+    _st_uring_pollset_add,
+    _st_uring_pollset_del,
+    _st_uring_fd_new,
+    _st_uring_fd_close,
+    _st_uring_fd_getlimit,
+    _st_uring_netfd_add,
+    _st_uring_netfd_del,
+    _st_uring_io
+};
+
+#endif /* _ST_HAVE_IO_URING */